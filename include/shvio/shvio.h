@@ -130,6 +130,14 @@ SHVIO *shvio_open(void);
  */
 SHVIO *shvio_open_named(const char *name);
 
+/**
+ * Open a handle that may use any VIO on the platform.
+ * Each setup runs on the least loaded VIO that has the hardware it needs,
+ * so jobs from several such handles are spread over all VIOs.
+ * \retval 0 Failure, otherwise VIO handle.
+ */
+SHVIO *shvio_open_pool(void);
+
 /**
  * Close a VIO device.
  * \param vio VIO handle
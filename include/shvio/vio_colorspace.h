@@ -233,6 +233,15 @@ typedef enum {
 #define BLEND_MODE_PREMULT	(1 << 0)
 #define BLEND_MODE_MASK		(1 << 0)
 
+/** Global alpha: blend the surface with the alpha given by BLEND_ALPHA(a),
+ * 0 (transparent) to 255 (opaque).  It applies to surfaces without an
+ * alpha channel. */
+#define BLEND_GLOBAL_ALPHA	(1 << 1)
+#define BLEND_ALPHA_SHIFT	8
+#define BLEND_ALPHA_MASK	(0xff << BLEND_ALPHA_SHIFT)
+#define BLEND_ALPHA(a)		(BLEND_GLOBAL_ALPHA | \
+				 (((a) & 0xff) << BLEND_ALPHA_SHIFT))
+
 
 /** Setup a (scale|rotate) & crop between YCbCr & RGB surfaces
  * The scaling factor is calculated from the surface sizes.
@@ -274,6 +283,80 @@ shvio_set_dst(
 	void *dst_py,
 	void *dst_pc);
 
+/** Set the source buffers as dma-buf file descriptors, replacing the
+ * addresses given to shvio_setup or shvio_set_src. The buffers are
+ * imported by the driver instead of pinning user pages. Not supported in
+ * bundle mode.
+ * \param vio VIO handle
+ * \param src_fd_y dma-buf fd of Y or RGB plane of source image
+ * \param src_fd_c dma-buf fd of CbCr plane of source image (ignored for RGB)
+ */
+void
+shvio_set_src_dmabuf(
+	SHVIO *vio,
+	int src_fd_y,
+	int src_fd_c);
+
+/** Buffer allocated by libviper */
+struct shvio_buffer {
+	int index;        /**< Index of the buffer in its pool */
+	int planes;       /**< Number of planes */
+	void *addr[2];    /**< CPU address of each plane */
+	int fd[2];        /**< dma-buf fd of each plane, owned by libviper */
+	size_t size[2];   /**< Size of each plane in bytes */
+};
+
+/** Allocate a pool of source buffers sized for the current setup.
+ * The buffers are allocated and pinned once by the driver. Passing the
+ * address of a pool buffer to shvio_setup or shvio_set_src queues it
+ * without any per-frame mapping cost. The pool stays valid until
+ * shvio_free_buffers, shvio_close or a shvio_setup with different
+ * parameters. Must be called after shvio_setup with nothing queued.
+ * \param vio VIO handle
+ * \param bufs Array filled in with the allocated buffers
+ * \param count Number of buffers wanted
+ * \retval -1 Error, otherwise the number of buffers allocated
+ */
+int
+shvio_alloc_src_buffers(
+	SHVIO *vio,
+	struct shvio_buffer *bufs,
+	int count);
+
+/** Allocate a pool of destination buffers sized for the current setup.
+ * See shvio_alloc_src_buffers.
+ * \param vio VIO handle
+ * \param bufs Array filled in with the allocated buffers
+ * \param count Number of buffers wanted
+ * \retval -1 Error, otherwise the number of buffers allocated
+ */
+int
+shvio_alloc_dst_buffers(
+	SHVIO *vio,
+	struct shvio_buffer *bufs,
+	int count);
+
+/** Free the buffer pools of the handle. Nothing is freed while operations
+ * are queued; wait for them first. Any dma-buf fds from the pools that
+ * were handed on must have been closed by their users.
+ * \param vio VIO handle
+ */
+void
+shvio_free_buffers(SHVIO *vio);
+
+/** Set the destination buffers as dma-buf file descriptors, replacing the
+ * addresses given to shvio_setup or shvio_set_dst. Not supported in bundle
+ * mode.
+ * \param vio VIO handle
+ * \param dst_fd_y dma-buf fd of Y or RGB plane of destination image
+ * \param dst_fd_c dma-buf fd of CbCr plane of destination image (ignored for RGB)
+ */
+void
+shvio_set_dst_dmabuf(
+	SHVIO *vio,
+	int dst_fd_y,
+	int dst_fd_c);
+
 /** Set the source addresses. This is typically used for bundle mode.
  * \param vio VIO handle
  * \param src_py Address of Y or RGB plane of source image
@@ -285,6 +368,70 @@ shvio_set_color_conversion(
 	int bt709,
 	int full_range);
 
+/** Set the number of VIO operations that may be in flight at once.
+ * With a depth greater than 1, shvio_setup and shvio_start may be called
+ * again for the next frame before shvio_wait has returned for the
+ * previous one. Each shvio_wait completes the oldest queued operation.
+ * A setup that needs a different hardware pipeline fails while
+ * operations are queued; wait for them first.
+ * \param vio VIO handle
+ * \param depth Maximum number of queued operations (default 1)
+ * \retval 0 Success
+ * \retval -1 Error: depth is out of range
+ */
+int
+shvio_set_queue_depth(
+	SHVIO *vio,
+	int depth);
+
+/** Set how long shvio_setup and the other setup functions wait for the
+ * hardware when it is in use by other handles or processes. Waiting
+ * threads of one process are served in arrival order; waiting processes
+ * take turns in no particular order.
+ * \param vio VIO handle
+ * \param timeout_ms Time to wait in milliseconds, 0 to fail immediately
+ * (default) or -1 to wait for ever
+ */
+void
+shvio_set_timeout(
+	SHVIO *vio,
+	int timeout_ms);
+
+/** Get the contention counters of the VIO device used by the handle.
+ * The counters are for the whole process.
+ * \param vio VIO handle
+ * \param waits Returns how many setups had to wait for the hardware
+ * \param timeouts Returns how many of those gave up
+ */
+void
+shvio_get_contention(
+	SHVIO *vio,
+	unsigned int *waits,
+	unsigned int *timeouts);
+
+/** Split the frames of later setups into horizontal stripes that are
+ * processed in parallel on separate hardware pipelines, on any VIO of the
+ * platform. shvio_start, shvio_submit, shvio_wait and shvio_poll then act
+ * on all stripes of the frame. Frames too small to be worth splitting are
+ * processed whole. Stripes don't wait for busy entities: with fewer free
+ * pipelines than stripes the frame is split into as many stripes as
+ * could be set up, or processed whole. Stripes overlap by the lines the
+ * scaler filters over, so the result is the same as without stripes;
+ * frames whose scaling ratio cannot be split exactly are processed whole.
+ * Bundle mode and dma-buf addresses are not supported with stripes.
+ * A setup for a frame of the same geometry keeps the stripes and only
+ * changes the addresses, so it may follow frames still queued; any other
+ * setup needs the striped frames waited for first.
+ * \param vio VIO handle
+ * \param stripes Number of stripes, 1 (default) disables striping
+ * \retval 0 Success
+ * \retval -1 Error: stripes is out of range
+ */
+int
+shvio_set_stripes(
+	SHVIO *vio,
+	int stripes);
+
 /** Start a VIO operation (non-bundle mode).
  * \param vio VIO handle
  */
@@ -302,6 +449,19 @@ shvio_has_bundle(
 	 SHVIO *vio);
 
 /** Start a VIO operation (bundle mode).
+ * bundle_lines is rounded down to whole units of the vertical scaling
+ * ratio where the frame has one, so that every bundle gives the same
+ * number of destination lines. When fewer lines than bundle_lines are
+ * left in the frame, the last bundle is filled out from its last lines
+ * in a buffer of the handle and its destination lines copied out when it
+ * completes, so the pipeline keeps the bundle size and only the lines of
+ * the frame are read and written.
+ * Up to the depth set by shvio_set_queue_depth bundles may be queued
+ * before shvio_wait, so the next bundle is processed while the previous
+ * one is being consumed. The destination address advances by itself;
+ * the source address is set with shvio_set_src before each bundle.
+ * A bundle that cannot be queued is dropped without notice, so the next
+ * shvio_wait reports an earlier bundle; shvio_submit_bundle reports it.
  * \param vio VIO handle
  * \param bundle_lines Number of lines to process
  */
@@ -310,15 +470,78 @@ shvio_start_bundle(
 	SHVIO *vio,
 	int bundle_lines);
 
-/** Wait for a VIO operation to complete. The operation is started by a call to shvio_start.
+/** Queue a VIO operation without waiting for it (bundle mode).
+ * This is shvio_start_bundle with an error return. A change of bundle
+ * size is only possible with no bundles queued: wait for them first.
+ * \param vio VIO handle
+ * \param bundle_lines Number of lines to process
+ * \retval 0 Success
+ * \retval -1 Error: no setup, stripe mode, too many queued operations,
+ * bundle size changed with bundles queued, or queueing failed
+ */
+int
+shvio_submit_bundle(
+	SHVIO *vio,
+	int bundle_lines);
+
+/** Wait for the oldest queued VIO operation to complete.
  * \param vio VIO handle
+ * \retval 0 Success
+ * \retval 1 Success, and the bundle completed the frame (bundle mode)
+ * \retval -1 Error: nothing queued, or the operation failed
  */
 int
 shvio_wait(SHVIO *vio);
 
+/** Set a function called each time a bundle completes, from shvio_wait
+ * or shvio_poll.  It is passed the number of destination lines of the
+ * frame that are done so far, and whether the frame is complete.
+ * \param vio VIO handle
+ * \param cb Callback, or NULL
+ * \param arg Passed to the callback
+ */
+void
+shvio_set_bundle_callback(
+	SHVIO *vio,
+	void (*cb)(void *arg, int lines, int end),
+	void *arg);
+
+/** Queue a VIO operation without waiting for it (non-bundle mode).
+ * This is shvio_start with an error return.
+ * \param vio VIO handle
+ * \retval 0 Success
+ * \retval -1 Error: no setup, too many queued operations or queueing
+ * failed. Operations already queued are dropped on a queueing failure.
+ * When a stripe fails to queue after others did, the frame is not
+ * reported by shvio_wait; the stripes already queued still process it.
+ */
+int
+shvio_submit(SHVIO *vio);
+
+/** Check whether the oldest queued VIO operation has completed, without
+ * blocking. If it has, it is retired as if by shvio_wait.
+ * \param vio VIO handle
+ * \retval 0 An operation completed
+ * \retval 1 The oldest operation is still being processed
+ * \retval -1 Error: nothing queued, or the operation failed
+ */
+int
+shvio_poll(SHVIO *vio);
+
+/** Get a file descriptor that becomes readable when a queued VIO operation
+ * completes, for use with poll/select/epoll. It may also be readable when
+ * nothing is queued; call shvio_poll to find out what happened.
+ * The descriptor is owned by the handle and closed by shvio_close.
+ * \param vio VIO handle
+ * \retval -1 Error, otherwise a file descriptor
+ */
+int
+shvio_get_fd(SHVIO *vio);
+
 
 /** Perform scale between YCbCr & RGB surfaces.
  * This operates on entire surfaces and blocks until completion.
+ * It fails while operations queued by shvio_submit are not waited for.
  *
  * \param vio VIO handle
  * \param src_surface Input surface
@@ -334,6 +557,7 @@ shvio_resize(
 
 /** Perform rotate between YCbCr & RGB surfaces
  * This operates on entire surfaces and blocks until completion.
+ * It fails while operations queued by shvio_submit are not waited for.
  *
  * \param vio VIO handle
  * \param src_surface Input surface
@@ -351,6 +575,9 @@ shvio_rotate(
 
 /** Perform filling a surface with a const ARGB color
  * This operates on entire surface and blocks until completion.
+ * To fill a rectangle, pass a surface from get_sel_surface. The alpha
+ * component of the color is not used.
+ * It fails while operations queued by shvio_submit are not waited for.
  *
  * \param vio VIO handle
  * \param dst_surface Output surface
@@ -385,6 +612,20 @@ int shvio_list_vio(char ***names, int *count);
  * \param dest Output surface.
  * \retval 0 Success
  * \retval -1 Error
+ *
+ * Layers hidden under an opaque layer, or outside the output, are skipped.
+ * Any number of layers may be given: when more are visible than the
+ * hardware blends at once, all but the last pass are run here; this fails
+ * while operations are queued on the handle.  Later passes read the result
+ * of the one before back from the scratch surface set with
+ * shvio_set_blend_scratch, or without one from the destination as it is
+ * being written, which is only done for RGB destinations.
+ *
+ * Calling this again with only the surface addresses or the blend_out
+ * position of layers changed reuses the blend pipeline, held or cached,
+ * so compositing the same layers every frame costs little more than
+ * queueing the buffers. Layers are not moved while operations set up
+ * with the old positions are still queued on the handle.
  */
 int
 shvio_setup_blend(
@@ -394,8 +635,50 @@ shvio_setup_blend(
 	int src_count,
 	const struct ren_vid_surface *dst);
 
-/** Perform a surface blend.
- * See shvio_start_blend for parameter definitions.
+/** Set a surface for the results of the earlier passes of a blend of more
+ * layers than the hardware blends at once, so that no pass reads back the
+ * buffer it writes. The passes alternate between it and the destination.
+ * It must be at least the size of the blend output; its format may differ
+ * from the destination's, e.g. an RGB one keeps the chroma detail of a
+ * YCbCr destination.
+ * \param vio VIO handle
+ * \param scratch Scratch surface, NULL to read back the destination
+ */
+void
+shvio_set_blend_scratch(
+	SHVIO *vio,
+	const struct ren_vid_surface *scratch);
+
+/** Setup a surface blend of only the damaged parts of the output.
+ * The layers are cropped to the damaged area and only that part of the
+ * destination is written; the rest of it is left as it is.  Nearby
+ * rectangles are blended as the rectangle bounding them, ones far apart
+ * each on their own, all but the last from within this call.  An area may
+ * grow a little so that layers are cropped on whole chroma samples.
+ * \param vio VIO handle
+ * \param virt See shvio_setup_blend
+ * \param src_list See shvio_setup_blend
+ * \param src_count See shvio_setup_blend
+ * \param dst See shvio_setup_blend
+ * \param damage Damaged rectangles in output coordinates
+ * \param damage_count Number of rectangles; 0 blends the whole output
+ * \retval 0 Success
+ * \retval -1 Error
+ */
+int
+shvio_setup_blend_damage(
+	SHVIO *vio,
+	const struct ren_vid_rect *virt,
+	const struct ren_vid_surface *const *src_list,
+	int src_count,
+	const struct ren_vid_surface *dst,
+	const struct ren_vid_rect *damage,
+	int damage_count);
+
+/** Perform a surface blend and wait for it to complete.
+ * See shvio_setup_blend for parameter definitions.
+ * \retval 0 Success
+ * \retval -1 Error, or operations queued by shvio_submit not waited for
  */
 int
 shvio_blend(
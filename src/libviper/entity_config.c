@@ -29,6 +29,111 @@
 #include "log.h"
 #include "viper_internal.h"
 
+#ifndef V4L2_PIX_FMT_FLAG_PREMUL_ALPHA
+#define V4L2_PIX_FMT_FLAG_PREMUL_ALPHA	0x00000001
+#endif
+
+void invalidate_entity_config(struct viper_entity *entity)
+{
+	entity->shadow.fmt_valid = 0;
+	entity->shadow.sel_valid = 0;
+	entity->shadow.video_fmt_valid = false;
+	entity->shadow.ctrl_valid = false;
+}
+
+/* The set_* helpers skip the ioctl when the same parameters were the last
+ * ones applied.  What is compared is the request, not the format the
+ * driver adjusted it to, as the same request gives the same result. */
+static int set_subdev_fmt(struct viper_entity *entity,
+			  struct v4l2_subdev_format *sfmt)
+{
+	struct viper_entity_shadow *shadow = &entity->shadow;
+	unsigned int pad_bit = 1 << sfmt->pad;
+	struct v4l2_mbus_framefmt format = sfmt->format;
+
+	if (sfmt->pad >= MAX_ENTITY_PADS)
+		return ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, sfmt);
+
+	if ((shadow->fmt_valid & pad_bit) &&
+			!memcmp(&shadow->fmt[sfmt->pad], &format,
+				sizeof(format)))
+		return 0;
+
+	/* A sink pad format propagates to the later pads and resets the
+	 * compose rectangle */
+	shadow->fmt_valid &= pad_bit - 1;
+	shadow->sel_valid &= pad_bit - 1;
+	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, sfmt))
+		return -1;
+
+	shadow->fmt[sfmt->pad] = format;
+	shadow->fmt_valid |= pad_bit;
+	return 0;
+}
+
+static int set_subdev_sel(struct viper_entity *entity,
+			  struct v4l2_subdev_selection *sel)
+{
+	struct viper_entity_shadow *shadow = &entity->shadow;
+	unsigned int pad_bit = 1 << sel->pad;
+	struct v4l2_rect r = sel->r;
+
+	if (sel->pad >= MAX_ENTITY_PADS)
+		return ioctl (entity->fd, VIDIOC_SUBDEV_S_SELECTION, sel);
+
+	if ((shadow->sel_valid & pad_bit) &&
+			!memcmp(&shadow->sel[sel->pad], &r, sizeof(r)))
+		return 0;
+
+	shadow->sel_valid &= ~pad_bit;
+	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_SELECTION, sel))
+		return -1;
+
+	shadow->sel[sel->pad] = r;
+	shadow->sel_valid |= pad_bit;
+	return 0;
+}
+
+static int set_video_fmt(struct viper_entity *entity, struct v4l2_format *fmt)
+{
+	struct viper_entity_shadow *shadow = &entity->shadow;
+	struct v4l2_format request = *fmt;
+
+	if (shadow->video_fmt_valid &&
+			!memcmp(&shadow->video_fmt, &request, sizeof(request)))
+		return 0;
+
+	shadow->video_fmt_valid = false;
+	if (ioctl (entity->io_entity->fd, VIDIOC_S_FMT, fmt))
+		return -1;
+
+	shadow->video_fmt = request;
+	shadow->video_fmt_valid = true;
+	return 0;
+}
+
+/* Each entity type has a single control set here, so the shadow keeps
+ * only its value */
+static int set_subdev_ctrl(struct viper_entity *entity, uint32_t id,
+			   int value)
+{
+	struct viper_entity_shadow *shadow = &entity->shadow;
+	struct v4l2_control ctrl;
+
+	if (shadow->ctrl_valid && shadow->ctrl_value == value)
+		return 0;
+
+	shadow->ctrl_valid = false;
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.id = id;
+	ctrl.value = value;
+	if (ioctl (entity->fd, VIDIOC_S_CTRL, &ctrl))
+		return -1;
+
+	shadow->ctrl_value = value;
+	shadow->ctrl_valid = true;
+	return 0;
+}
 
 int configure_rpf(struct viper_entity *entity, void *args)
 {
@@ -44,7 +149,7 @@ int configure_rpf(struct viper_entity *entity, void *args)
 	sfmt.format.code = rpf_conf->in_code;
 	sfmt.format.field = V4L2_FIELD_NONE;
 	sfmt.format.colorspace = V4L2_COLORSPACE_SRGB;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n", __FUNCTION__,
 			sfmt.pad);
 		return -1;
@@ -52,7 +157,7 @@ int configure_rpf(struct viper_entity *entity, void *args)
 
 	sfmt.pad = 1;
 	sfmt.format.code = rpf_conf->out_code;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n", __FUNCTION__,
 			sfmt.pad);
 		return -1;
@@ -67,12 +172,21 @@ int configure_rpf(struct viper_entity *entity, void *args)
 	fmt.fmt.pix_mp.plane_fmt[0].bytesperline = rpf_conf->bpitch0;
 	fmt.fmt.pix_mp.plane_fmt[1].bytesperline = rpf_conf->bpitch1;
 	fmt.fmt.pix_mp.num_planes = rpf_conf->planes;
+	if (rpf_conf->premultiplied)
+		fmt.fmt.pix_mp.flags = V4L2_PIX_FMT_FLAG_PREMUL_ALPHA;
 
-	if (ioctl (entity->io_entity->fd, VIDIOC_S_FMT, &fmt)) {
+	if (set_video_fmt(entity, &fmt)) {
 		viper_log("%s: VIDIOC_S_FMT failed - %d\n", __FUNCTION__,
 			errno);
 		return -1;
 	}
+
+	/* Drivers without the control only do opaque layers */
+	if (set_subdev_ctrl(entity, V4L2_CID_ALPHA_COMPONENT,
+			    rpf_conf->alpha) && rpf_conf->alpha != 255) {
+		viper_log("%s: cannot set alpha - %d\n", __FUNCTION__, errno);
+		return -1;
+	}
 	return 0;
 }
 
@@ -80,6 +194,7 @@ int configure_rpf(struct viper_entity *entity, void *args)
 int configure_wpf(struct viper_entity *entity, void *args)
 {
 	struct viper_wpf_config *wpf_conf = (struct viper_wpf_config *)args;
+	struct v4l2_subdev_selection sel;
 	struct v4l2_subdev_format sfmt;
 	struct v4l2_format fmt;
 
@@ -87,19 +202,37 @@ int configure_wpf(struct viper_entity *entity, void *args)
 	sfmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
 	sfmt.pad = 0;
 	sfmt.format.width = wpf_conf->width;
-	sfmt.format.height = wpf_conf->height;
+	sfmt.format.height = wpf_conf->height + wpf_conf->margin_top +
+		wpf_conf->margin_bottom;
 	sfmt.format.code = wpf_conf->in_code;
 	sfmt.format.field = V4L2_FIELD_NONE;
 	sfmt.format.colorspace = V4L2_COLORSPACE_SRGB;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n", __FUNCTION__,
 			sfmt.pad);
 		return -1;
 	}
 
+	/* The sink format reset the crop to the whole input */
+	if (wpf_conf->margin_top || wpf_conf->margin_bottom) {
+		memset(&sel, 0, sizeof(struct v4l2_subdev_selection));
+		sel.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+		sel.target = V4L2_SUBDEV_SEL_TGT_CROP_ACTUAL;
+		sel.pad = 0;
+		sel.r.top = wpf_conf->margin_top;
+		sel.r.width = wpf_conf->width;
+		sel.r.height = wpf_conf->height;
+		if (set_subdev_sel(entity, &sel)) {
+			viper_log("%s: VIDIOC_SUBDEV_S_SELECTION failed - %d\n",
+				__FUNCTION__, errno);
+			return -1;
+		}
+	}
+
 	sfmt.pad = 1;
+	sfmt.format.height = wpf_conf->height;
 	sfmt.format.code = wpf_conf->out_code;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n", __FUNCTION__,
 			sfmt.pad);
 		return -1;
@@ -115,7 +248,7 @@ int configure_wpf(struct viper_entity *entity, void *args)
 	fmt.fmt.pix_mp.plane_fmt[1].bytesperline = wpf_conf->bpitch1;
 	fmt.fmt.pix_mp.num_planes = wpf_conf->planes;
 
-	if (ioctl (entity->io_entity->fd, VIDIOC_S_FMT, &fmt)) {
+	if (set_video_fmt(entity, &fmt)) {
 		viper_log("%s: VIDIOC_S_FMT failed - %d\n", __FUNCTION__,
 			errno);
 		return -1;
@@ -138,7 +271,7 @@ int configure_uds(struct viper_entity *entity, void *args)
 	sfmt.format.code = uds_conf->code;
 	sfmt.format.field = V4L2_FIELD_NONE;
 	sfmt.format.colorspace = V4L2_COLORSPACE_SRGB;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n", __FUNCTION__,
 			sfmt.pad);
 		return -1;
@@ -147,7 +280,7 @@ int configure_uds(struct viper_entity *entity, void *args)
 	sfmt.pad = 1;
 	sfmt.format.width = uds_conf->out_width;
 	sfmt.format.height = uds_conf->out_height;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n", __FUNCTION__,
 			sfmt.pad);
 		return -1;
@@ -173,7 +306,7 @@ int configure_bru(struct viper_entity *entity, void *args)
 		sfmt.pad = i;
 		sfmt.format.width = bru_conf->in_widths[i];
 		sfmt.format.height = bru_conf->in_heights[i];
-		if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+		if (set_subdev_fmt(entity, &sfmt)) {
 			viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n",
 				__FUNCTION__, sfmt.pad);
 			return -1;
@@ -183,7 +316,7 @@ int configure_bru(struct viper_entity *entity, void *args)
 	sfmt.pad = BRU_OUTPUT_PAD;
 	sfmt.format.width = bru_conf->out_width;
 	sfmt.format.height = bru_conf->out_height;
-	if (ioctl (entity->fd, VIDIOC_SUBDEV_S_FMT, &sfmt)) {
+	if (set_subdev_fmt(entity, &sfmt)) {
 		viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n",
 			__FUNCTION__, sfmt.pad);
 			return -1;
@@ -197,11 +330,19 @@ int configure_bru(struct viper_entity *entity, void *args)
 		sel.r.top = bru_conf->in_tops[i];
 		sel.r.width = bru_conf->in_widths[i];
 		sel.r.height = bru_conf->in_heights[i];
-		if (ioctl (entity->fd, VIDIOC_SUBDEV_S_SELECTION, &sel)) {
+		if (set_subdev_sel(entity, &sel)) {
 			viper_log("%s: VIDIOC_SUBDEV_S_FMT failed %d\n",
 				__FUNCTION__, sel.pad);
 			return -1;
 		}
 	}
+
+	/* Drivers without the control leave the background black */
+	if (set_subdev_ctrl(entity, V4L2_CID_BG_COLOR, bru_conf->bg_color) &&
+			bru_conf->bg_color) {
+		viper_log("%s: cannot set background - %d\n", __FUNCTION__,
+			errno);
+		return -1;
+	}
 	return 0;
 }
@@ -23,6 +23,8 @@
 #ifndef ENTITY_CONF_H
 #define ENTITY_CONF_H
 #include "viper_internal.h"
+void invalidate_entity_config(struct viper_entity *entity);
+
 struct viper_rpf_config {
 	int width;
 	int height;
@@ -34,6 +36,8 @@ struct viper_rpf_config {
 	enum v4l2_mbus_pixelcode in_code;
 	uint32_t out_format;
 	enum v4l2_mbus_pixelcode out_code;
+	bool premultiplied;
+	int alpha;		/* global alpha, 255 for opaque */
 };
 int configure_rpf(struct viper_entity *entity, void *args);
 
@@ -48,6 +52,9 @@ struct viper_wpf_config {
 	enum v4l2_mbus_pixelcode in_code;
 	uint32_t out_format;
 	enum v4l2_mbus_pixelcode out_code;
+	/* lines received above and below the ones written, cropped off */
+	int margin_top;
+	int margin_bottom;
 };
 int configure_wpf(struct viper_entity *entity, void *args);
 
@@ -66,12 +73,14 @@ int configure_uds(struct viper_entity *entity, void *args);
 struct viper_bru_config {
 	int in_widths[BRU_MAX_INPUTS];
 	int in_heights[BRU_MAX_INPUTS];
-	int in_tops[BRU_MAX_INPUTS];
-	int in_lefts[BRU_MAX_INPUTS];
 	int out_width;
 	int out_height;
 	int inputs;
 	enum v4l2_mbus_pixelcode code;
+	uint32_t bg_color;	/* in the colour space of 'code' */
+	/* Layer positions come last: they are changed in place */
+	int in_tops[BRU_MAX_INPUTS];
+	int in_lefts[BRU_MAX_INPUTS];
 };
 
 int configure_bru(struct viper_entity *entity, void *args);
@@ -27,6 +27,8 @@
 #include <poll.h>
 #include <shvio/shvio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 #include "viper_internal.h"
 
 struct vio_format {
@@ -35,6 +37,30 @@ struct vio_format {
 	int v4l_planes;
 };
 
+/* devices a pool handle tries before waiting, see shvio_open_pool */
+#define MAX_POOL_DEVICES 8
+
+/* see shvio_set_stripes */
+#define MAX_STRIPES 4
+#define MIN_STRIPE_LINES 64
+/* The UDS scales by a ratio in 1/UDS_RATIO_ONE steps, filtering over
+ * UDS_TAPS lines */
+#define UDS_RATIO_ONE 4096
+#define UDS_TAPS 4
+
+/* see tail_buffer */
+#define TAIL_BUF_ALIGN 4096
+#define TAIL_BUF_ROUND(x) (((size_t)(x) + TAIL_BUF_ALIGN - 1) & \
+			   ~(size_t)(TAIL_BUF_ALIGN - 1))
+
+struct shvio_job {
+	int	lines;		/* output lines of the frame done after it */
+	bool	last;		/* completes the frame */
+	bool	bundle;
+	bool	dropped;	/* part of a striped frame that failed to queue */
+	bool	tail;		/* output in tail_buf, see tail_buffer */
+};
+
 struct SHVIO {
 	struct viper_device *device;
 	struct viper_pipeline *pipeline;
@@ -42,19 +68,69 @@ struct SHVIO {
 	struct viper_rpf_config rpf_set;
 	struct viper_wpf_config wpf_set;
 	struct viper_uds_config uds_set;
-	int bundle_lines_remaining;
-	int bundle_lines;
-	int output_y_offset;
-	int output_c_offset;
+	/* lines the pipeline is set up for, 0 for whole frames */
+	int bundle_hw_lines;
+	/* the last bundle of the frame, see tail_buffer */
+	char *tail_buf;
+	size_t tail_buf_size;
+	void *tail_src[MAX_PLANES];
+	void *tail_dst[MAX_PLANES];
+	int tail_size[MAX_PLANES];
+	int input_lines_done;
+	int output_lines_done;
+	bool resize;
+	ren_vid_format_t src_format;
+	ren_vid_format_t dst_format;
+/* queued jobs, oldest first, see retire_job */
+	struct shvio_job jobs[MAX_QUEUE_DEPTH];
+	int job_head;
+	int job_count;
+	void (*bundle_cb)(void *arg, int lines, int end);
+	void *bundle_cb_arg;
+/* jobs that may be queued before shvio_wait */
+	int queue_depth;
+/* epoll fd over the output queues, see shvio_get_fd */
+	int poll_fd;
+/* how long shvio_setup waits for busy hardware, -1 for ever */
+	int timeout_ms;
+/* pick the least loaded device for each setup, see shvio_open_pool */
+	bool any_device;
+/* stripe mode: one pool handle per horizontal stripe of the frame */
+	int stripes;
+	int active_stripes;
+	SHVIO *stripe_vio[MAX_STRIPES];
+	int stripe_src_offset[MAX_STRIPES][MAX_PLANES];
+	int stripe_dst_offset[MAX_STRIPES][MAX_PLANES];
+	bool stripe_done[MAX_STRIPES];
+	/* the frame the stripes are laid out for, see same_stripe_frame */
+	int stripes_asked;
+	struct ren_vid_surface stripe_src;
+	struct ren_vid_surface stripe_dst;
+/* for a stripe: output lines computed around the destination, see
+ * setup_stripes */
+	int margin_top;
+	int margin_bottom;
+/* entity configs of shvio_setup_blend, kept here so that it doesn't
+ * allocate per call */
+	struct viper_rpf_config blend_rpf[BRU_MAX_INPUTS];
+	struct viper_uds_config blend_uds[BRU_MAX_INPUTS];
+	struct viper_bru_config blend_bru;
+/* results of the earlier passes of a blend, see shvio_set_blend_scratch */
+	struct ren_vid_surface blend_scratch;
+/* layers cropped to a damaged area, see shvio_setup_blend_damage */
+	struct ren_vid_surface *damage_layers;
+	const struct ren_vid_surface **damage_list;
+	int damage_size;
 };
 
 extern struct viper_context viper;
 
+/* 'margins' are destination lines computed but not written */
 static int is_resize(const struct ren_vid_surface *src_surface,
-		     const struct ren_vid_surface *dst_surface)
+		     const struct ren_vid_surface *dst_surface, int margins)
 {
 	return ((src_surface->w != dst_surface->w) ||
-		(src_surface->h != dst_surface->h));
+		(src_surface->h != dst_surface->h + margins));
 }
 
 static int is_resize_rect(const struct ren_vid_surface *src)
@@ -100,10 +176,18 @@ static const struct vio_format * lookup_v4l_color(uint32_t v4l_color) {
 	return NULL;
 }
 
+static SHVIO *vio_new(struct viper_device *device) {
+	struct SHVIO *vio;
+	vio = calloc(1, sizeof(struct SHVIO));
+	vio->device = device;
+	vio->queue_depth = 1;
+	vio->poll_fd = -1;
+	return vio;
+}
+
 SHVIO *shvio_open_named(const char *name) {
 	init_context();
 	struct viper_device *device = viper.device_list;
-	struct SHVIO *vio;
 
 
 	if (!device) {
@@ -111,18 +195,12 @@ SHVIO *shvio_open_named(const char *name) {
 		return NULL;
 	}
 
-	if (!name) {
-		vio = calloc(1, sizeof(struct SHVIO));
-		vio->device = device;
-		return vio;
-	}
+	if (!name)
+		return vio_new(device);
 
 	while (device) {
-		if (!strncasecmp(name, device->name, strlen(name))) {
-			vio = calloc(1, sizeof(struct SHVIO));
-			vio->device = device;
-			return vio;
-		}
+		if (!strncasecmp(name, device->name, strlen(name)))
+			return vio_new(device);
 		device = device->next;
 	}
 	return NULL;
@@ -132,22 +210,290 @@ SHVIO *shvio_open(void) {
 	return shvio_open_named(NULL);
 }
 
+SHVIO *shvio_open_pool(void) {
+	SHVIO *vio;
+
+	init_context();
+	if (!viper.device_list) {
+		viper_log("no device");
+		deinit_context();
+		return NULL;
+	}
+
+	vio = vio_new(viper.device_list);
+	vio->any_device = true;
+	return vio;
+}
+
 void shvio_close(SHVIO *vio) {
 	struct viper_pipeline *pipe = vio->pipeline;
+	int i;
+	for (i = 0; i < MAX_STRIPES; i++) {
+		if (vio->stripe_vio[i])
+			shvio_close(vio->stripe_vio[i]);
+	}
 	if (pipe) {
-		int i;
-		for (i = 0; i < pipe->num_inputs; i++) {
-			stop_io_device(pipe->input_fds[i], true);
+		/* Drop any jobs still queued before handing it back */
+		stop_pipeline(pipe);
+		release_pipeline(vio->device, pipe);
+	}
+	if (vio->poll_fd >= 0)
+		close(vio->poll_fd);
+	free(vio->damage_layers);
+	free(vio->damage_list);
+	free(vio->tail_buf);
+	free(vio);
+	deinit_context();
+}
+
+int shvio_set_queue_depth(SHVIO *vio, int depth)
+{
+	if (depth < 1 || depth > MAX_QUEUE_DEPTH)
+		return -1;
+	vio->queue_depth = depth;
+	return 0;
+}
+
+void shvio_set_timeout(SHVIO *vio, int timeout_ms)
+{
+	vio->timeout_ms = timeout_ms;
+}
+
+void shvio_get_contention(SHVIO *vio, unsigned int *waits,
+			  unsigned int *timeouts)
+{
+	struct viper_device *dev = vio->device;
+
+	pthread_mutex_lock(&dev->lock);
+	if (waits)
+		*waits = dev->waits;
+	if (timeouts)
+		*timeouts = dev->timeouts;
+	pthread_mutex_unlock(&dev->lock);
+}
+
+static bool queue_full(SHVIO *vio, struct viper_pipeline *pipe)
+{
+	return (pipe->queued >= vio->queue_depth ||
+		pipe->queued >= pipe->buffers);
+}
+
+static void watch_pipeline(SHVIO *vio, struct viper_pipeline *pipe, int op)
+{
+	struct epoll_event ev;
+	int i;
+
+	if (vio->poll_fd < 0 || !pipe)
+		return;
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = pipe->output_fds[i];
+		if (epoll_ctl(vio->poll_fd, op, pipe->output_fds[i], &ev))
+			viper_log("%s: epoll_ctl failed - %d\n", __FUNCTION__,
+				errno);
+	}
+}
+
+/* Switch the pipeline held by the handle, keeping the poll fd watching
+ * the output queues of the current one */
+static void set_pipeline(SHVIO *vio, struct viper_pipeline *pipe)
+{
+	if (vio->pipeline == pipe)
+		return;
+	watch_pipeline(vio, vio->pipeline, EPOLL_CTL_DEL);
+	watch_pipeline(vio, pipe, EPOLL_CTL_ADD);
+	vio->pipeline = pipe;
+}
+
+static void push_job(SHVIO *vio, int lines, bool last, bool bundle)
+{
+	struct shvio_job *job;
+
+	job = &vio->jobs[(vio->job_head + vio->job_count) % MAX_QUEUE_DEPTH];
+	job->lines = lines;
+	job->last = last;
+	job->bundle = bundle;
+	job->dropped = false;
+	job->tail = false;
+	vio->job_count++;
+}
+
+/* The newest job is retired unreported when its turn comes, see
+ * shvio_wait */
+static void drop_last_job(SHVIO *vio)
+{
+	if (vio->job_count)
+		vio->jobs[(vio->job_head + vio->job_count - 1) %
+			  MAX_QUEUE_DEPTH].dropped = true;
+}
+
+/* Dequeue the oldest job from every queue of the pipeline, and return
+ * its bookkeeping in 'done' if not NULL */
+static int retire_job(SHVIO *vio, struct viper_pipeline *pipe,
+		      struct shvio_job *done)
+{
+	int i;
+	int ret = 0;
+
+	for (i = 0; i < pipe->num_inputs; i++) {
+		if (dequeue_buffer(pipe->input_fds[i], true,
+				pipe->input_queue_memory[i]) < 0)
+			ret = -1;
+	}
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		if (dequeue_buffer(pipe->output_fds[i], false,
+				pipe->output_queue_memory[i]) < 0)
+			ret = -1;
+	}
+	pipeline_job_done(pipe);
+
+	if (vio->job_count) {
+		if (done)
+			*done = vio->jobs[vio->job_head];
+		vio->job_head = (vio->job_head + 1) % MAX_QUEUE_DEPTH;
+		vio->job_count--;
+	} else if (done) {
+		memset(done, 0, sizeof(*done));
+		done->last = true;
+	}
+	return ret;
+}
+
+/* The least loaded device not in 'tried'.  Load is the number of jobs
+ * this process has queued on the device; devices whose entities are
+ * locked by other processes show up as failing to build a pipeline. */
+static struct viper_device * least_loaded_device(struct viper_device **tried,
+						 int num_tried,
+						 struct viper_device *prefer)
+{
+	struct viper_device *dev, *best = prefer;
+	int i;
+
+	for (i = 0; i < num_tried; i++) {
+		if (tried[i] == prefer)
+			best = NULL;
+	}
+
+	for (dev = viper.device_list; dev; dev = dev->next) {
+		for (i = 0; i < num_tried; i++) {
+			if (tried[i] == dev)
+				break;
 		}
+		if (i < num_tried)
+			continue;
+		if (!best || dev->inflight < best->inflight)
+			best = dev;
+	}
+	return best;
+}
 
-		for (i = 0; i < pipe->num_outputs; i++) {
-			stop_io_device(pipe->output_fds[i], false);
+/* Try every device, least loaded first, then wait on the least loaded
+ * one if the handle has a timeout */
+static struct viper_pipeline * create_pool_pipeline(SHVIO *vio, int *caps,
+						    void **args, int count)
+{
+	struct viper_device *tried[MAX_POOL_DEVICES];
+	struct viper_device *dev;
+	struct viper_pipeline *pipe = NULL;
+	int num_tried = 0;
+
+	/* Ties go to the device the handle used last */
+	while (num_tried < MAX_POOL_DEVICES &&
+			(dev = least_loaded_device(tried, num_tried,
+						   vio->device))) {
+		pipe = create_pipeline(dev, caps, args, count, 0);
+		if (pipe) {
+			vio->device = dev;
+			return pipe;
 		}
+		tried[num_tried++] = dev;
+	}
 
-		free_pipeline(vio->device, pipe);
+	if (!vio->timeout_ms)
+		return NULL;
+
+	dev = least_loaded_device(NULL, 0, vio->device);
+	pipe = create_pipeline(dev, caps, args, count, vio->timeout_ms);
+	if (pipe)
+		vio->device = dev;
+	return pipe;
+}
+
+/* Switching pipelines or running passes of our own would leave the jobs
+ * the caller queued with nothing for shvio_wait to report, so that is
+ * refused until they are waited for */
+static bool jobs_queued(SHVIO *vio, const char *func)
+{
+	if (!vio->pipeline || !vio->pipeline->queued)
+		return false;
+	viper_log("%s: %d jobs still queued\n", func,
+		  vio->pipeline->queued);
+	return true;
+}
+
+/* Keep the pipeline the handle still holds if it matches the new setup.
+ * A pool handle with nothing queued moves to a less loaded device.
+ * Otherwise the pipeline is handed back and one got from the device,
+ * which is refused while it still has jobs queued. */
+static struct viper_pipeline * acquire_pipeline(SHVIO *vio, int *caps,
+						void **args, int count)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+
+	if (pipe) {
+		if (pipeline_matches(pipe, caps, args, count) &&
+				(!vio->any_device || pipe->queued ||
+				 pipeline_has_buffers(pipe) ||
+				 least_loaded_device(NULL, 0, NULL)->inflight >=
+				 vio->device->inflight))
+			return pipe;
+		if (jobs_queued(vio, __FUNCTION__))
+			return NULL;
+		set_pipeline(vio, NULL);
+		release_pipeline(vio->device, pipe);
 	}
-	free(vio);
-	deinit_context();
+
+	if (vio->any_device)
+		return create_pool_pipeline(vio, caps, args, count);
+	return create_pipeline(vio->device, caps, args, count,
+			       vio->timeout_ms);
+}
+
+/* Addresses inside a buffer from the pipeline's buffer pool select that
+ * pool buffer, anything else is queued as a user pointer. */
+static void set_input_addr(struct viper_pipeline *pipe, int idx,
+			   void *py, void *pc)
+{
+	int i;
+	pipe->input_memory[idx] = V4L2_MEMORY_USERPTR;
+	for (i = 0; i < pipe->input_pool_size[idx]; i++) {
+		if (pipe->input_pool[idx][i].addr[0] == py) {
+			pipe->input_memory[idx] = V4L2_MEMORY_MMAP;
+			pipe->input_index[idx] = i;
+			break;
+		}
+	}
+	pipe->input_addr[idx][0] = py;
+	pipe->input_addr[idx][1] = pc;
+}
+
+static void set_output_addr(struct viper_pipeline *pipe, int idx,
+			    void *py, void *pc)
+{
+	int i;
+	pipe->output_memory[idx] = V4L2_MEMORY_USERPTR;
+	for (i = 0; i < pipe->output_pool_size[idx]; i++) {
+		if (pipe->output_pool[idx][i].addr[0] == py) {
+			pipe->output_memory[idx] = V4L2_MEMORY_MMAP;
+			pipe->output_index[idx] = i;
+			break;
+		}
+	}
+	pipe->output_addr[idx][0] = py;
+	pipe->output_addr[idx][1] = pc;
 }
 
 void
@@ -163,10 +509,32 @@ shvio_set_src(
 	void *src_pc)
 {
 	struct viper_pipeline *pipe = vio->pipeline;
+	int i;
+	for (i = 0; i < vio->active_stripes; i++)
+		shvio_set_src(vio->stripe_vio[i],
+			src_py + vio->stripe_src_offset[i][0],
+			src_pc ? src_pc + vio->stripe_src_offset[i][1] : NULL);
 	if (!pipe)
 		return;
-	pipe->input_addr[0][0] = src_py;
-	pipe->input_addr[0][1] = src_pc;
+	set_input_addr(pipe, 0, src_py, src_pc);
+}
+
+void
+shvio_set_src_dmabuf(
+	SHVIO *vio,
+	int src_fd_y,
+	int src_fd_c)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+	if (vio->active_stripes) {
+		viper_log("%s: not supported in stripe mode\n", __FUNCTION__);
+		return;
+	}
+	if (!pipe)
+		return;
+	pipe->input_memory[0] = V4L2_MEMORY_DMABUF;
+	pipe->input_dmabuf[0][0] = src_fd_y;
+	pipe->input_dmabuf[0][1] = src_fd_c;
 }
 
 void
@@ -176,10 +544,32 @@ shvio_set_dst(
 	void *dst_pc)
 {
 	struct viper_pipeline *pipe = vio->pipeline;
+	int i;
+	for (i = 0; i < vio->active_stripes; i++)
+		shvio_set_dst(vio->stripe_vio[i],
+			dst_py + vio->stripe_dst_offset[i][0],
+			dst_pc ? dst_pc + vio->stripe_dst_offset[i][1] : NULL);
+	if (!pipe)
+		return;
+	set_output_addr(pipe, 0, dst_py, dst_pc);
+}
+
+void
+shvio_set_dst_dmabuf(
+	SHVIO *vio,
+	int dst_fd_y,
+	int dst_fd_c)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+	if (vio->active_stripes) {
+		viper_log("%s: not supported in stripe mode\n", __FUNCTION__);
+		return;
+	}
 	if (!pipe)
 		return;
-	pipe->output_addr[0][0] = dst_py;
-	pipe->output_addr[0][1] = dst_pc;
+	pipe->output_memory[0] = V4L2_MEMORY_DMABUF;
+	pipe->output_dmabuf[0][0] = dst_fd_y;
+	pipe->output_dmabuf[0][1] = dst_fd_c;
 }
 
 static int setup_rpf(struct viper_rpf_config *rpf_set,
@@ -208,6 +598,8 @@ static int setup_rpf(struct viper_rpf_config *rpf_set,
 	rpf_set->in_code = color_fmt_to_code(fmt->v4l_format);
 	rpf_set->out_format = out_fmt->v4l_format;
 	rpf_set->out_code = color_fmt_to_code(out_fmt->v4l_format);
+	rpf_set->premultiplied = false;
+	rpf_set->alpha = 255;
 	return fmt->v4l_planes;
 }
 
@@ -233,22 +625,386 @@ static int setup_wpf(struct viper_wpf_config *wpf_set,
 	wpf_set->in_code = color_fmt_to_code(in_fmt->v4l_format);
 	wpf_set->out_format = out_fmt->v4l_format;
 	wpf_set->out_code = color_fmt_to_code(out_fmt->v4l_format);
+	wpf_set->margin_top = 0;
+	wpf_set->margin_bottom = 0;
 	return out_fmt->v4l_planes;
 }
 
 
+/* The poll fd of a striped handle watches those of its stripes */
+static void watch_stripe(SHVIO *vio, SHVIO *stripe)
+{
+	struct epoll_event ev;
+	int fd;
+
+	if (vio->poll_fd < 0 || (fd = shvio_get_fd(stripe)) < 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(vio->poll_fd, EPOLL_CTL_ADD, fd, &ev))
+		viper_log("%s: epoll_ctl failed - %d\n", __FUNCTION__, errno);
+}
+
+void shvio_set_bundle_callback(SHVIO *vio,
+			       void (*cb)(void *arg, int lines, int end),
+			       void *arg)
+{
+	vio->bundle_cb = cb;
+	vio->bundle_cb_arg = arg;
+}
+
+int shvio_set_stripes(SHVIO *vio, int stripes)
+{
+	if (stripes < 1 || stripes > MAX_STRIPES)
+		return -1;
+	vio->stripes = stripes;
+	return 0;
+}
+
+void shvio_set_blend_scratch(SHVIO *vio,
+			     const struct ren_vid_surface *scratch)
+{
+	if (scratch)
+		vio->blend_scratch = *scratch;
+	else
+		memset(&vio->blend_scratch, 0, sizeof(vio->blend_scratch));
+}
+
+/* Bytes of each plane taken by 'lines' lines of a frame, given the byte
+ * pitches of its planes.  'lines' must be a multiple of the chroma
+ * vertical subsampling, see vert_increment. */
+static void plane_bytes(ren_vid_format_t format, int bpitch0, int bpitch1,
+			int lines, int *bytes)
+{
+	bytes[0] = bpitch0 * lines;
+	bytes[1] = size_c(format, bpitch1 * lines, 0);
+}
+
+/* Byte offsets of the first line of a stripe in each plane */
+static void stripe_offset(const struct ren_vid_surface *surface, int line,
+			  int *offset)
+{
+	plane_bytes(surface->format,
+		    size_y(surface->format, surface->pitch, surface->bpitchy),
+		    size_y(surface->format, surface->pitch, surface->bpitchc),
+		    line, offset);
+}
+
+static void stripe_surface(struct ren_vid_surface *out,
+			   const struct ren_vid_surface *in,
+			   int line, int lines, int *offset)
+{
+	stripe_offset(in, line, offset);
+	*out = *in;
+	out->h = lines;
+	if (in->py)
+		out->py += offset[0];
+	if (in->pc)
+		out->pc += offset[1];
+}
+
+/* Stripes queue jobs of their own, which setting up again would drop */
+static bool stripe_jobs_queued(SHVIO *vio, const char *func)
+{
+	int i;
+	for (i = 0; i < vio->active_stripes; i++) {
+		if (jobs_queued(vio->stripe_vio[i], func))
+			return true;
+	}
+	return false;
+}
+
+/* The blocking calls wait for the job they queue, which would be another
+ * one if the caller still has jobs queued: those are refused until the
+ * caller has waited for them */
+static bool handle_busy(SHVIO *vio, const char *func)
+{
+	return jobs_queued(vio, func) || stripe_jobs_queued(vio, func);
+}
+
+/* Hand back the pipelines held by the stripes from 'first' on, which have
+ * nothing queued */
+static void release_stripes(SHVIO *vio, int first)
+{
+	struct viper_pipeline *pipe;
+	int i;
+
+	for (i = first; i < MAX_STRIPES; i++) {
+		if (!vio->stripe_vio[i] || !(pipe = vio->stripe_vio[i]->pipeline))
+			continue;
+		set_pipeline(vio->stripe_vio[i], NULL);
+		release_pipeline(vio->stripe_vio[i]->device, pipe);
+	}
+	if (vio->active_stripes > first)
+		vio->active_stripes = first;
+}
+
+/* Stripe edges fall on multiples of a unit of lines, in which the frame
+ * is scaled by a whole number of steps */
+struct stripe_layout {
+	int unit_src;	/* source lines of a unit */
+	int unit_dst;	/* destination lines of a unit */
+	int units;	/* units in the frame */
+	int margin;	/* units computed around each stripe edge */
+};
+
+static int gcd(int a, int b)
+{
+	int t;
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* The smallest whole number of source and destination lines in which a
+ * frame of 'src_h' lines is scaled to 'dst_h', in whole chroma lines.
+ * Returns false if the frame has no such unit. */
+static bool scale_unit(int src_h, int dst_h, int align, int *unit_src,
+		       int *unit_dst)
+{
+	int div, k;
+
+	if (!src_h || !dst_h)
+		return false;
+
+	div = gcd(src_h, dst_h);
+	for (k = 1; k <= align; k++) {
+		if (!(k * (src_h / div) % align) &&
+		    !(k * (dst_h / div) % align))
+			break;
+	}
+	if (k > align || div % k)
+		return false;
+
+	*unit_src = k * (src_h / div);
+	*unit_dst = k * (dst_h / div);
+	return true;
+}
+
+/* A stripe comes out as in the whole frame when it is scaled with exactly
+ * the frame's ratio, starting on a line where the frame's scaling steps
+ * start over, and its filter sees the same lines as at its edges in the
+ * frame.  So the ratio must be exact in the UDS's fixed point, stripe
+ * edges fall on whole units, and each stripe is computed with margins
+ * covering the filter taps, which the WPF crops off.  Returns false if
+ * the frame can't be split that way. */
+static bool stripe_layout(const struct ren_vid_surface *src_surface,
+			  const struct ren_vid_surface *dst_surface,
+			  struct stripe_layout *layout)
+{
+	int src_h = src_surface->h, dst_h = dst_surface->h;
+	int align, taps;
+
+	if (!src_h || !dst_h ||
+	    (long long)src_h * UDS_RATIO_ONE % dst_h)
+		return false;
+
+	align = vert_increment(src_surface->format);
+	if (vert_increment(dst_surface->format) > align)
+		align = vert_increment(dst_surface->format);
+
+	if (!scale_unit(src_h, dst_h, align, &layout->unit_src,
+			&layout->unit_dst))
+		return false;
+	layout->units = src_h / layout->unit_src;
+	/* Source lines the filter reaches on either side of a line */
+	taps = UDS_TAPS / 2 * ((src_h + dst_h - 1) / dst_h);
+	layout->margin = (taps + layout->unit_src - 1) / layout->unit_src;
+	return true;
+}
+
+/* Set the frame up as 'stripes' stripes.  Returns the number of stripes
+ * that could be set up, or -1 if a pool handle cannot be opened. */
+static int try_stripes(SHVIO *vio, int stripes,
+		       const struct stripe_layout *layout,
+		       const struct ren_vid_surface *src_surface,
+		       const struct ren_vid_surface *dst_surface)
+{
+	struct ren_vid_surface src, dst;
+	struct viper_device *dev = viper.device_list;
+	int i, first, next, top, bottom;
+
+	for (i = 0; i < stripes; i++) {
+		SHVIO *stripe = vio->stripe_vio[i];
+		if (!stripe) {
+			stripe = vio->stripe_vio[i] = shvio_open_pool();
+			if (!stripe)
+				return -1;
+			/* Start each stripe on a different device */
+			stripe->device = dev;
+			watch_stripe(vio, stripe);
+		}
+		if (dev && !(dev = dev->next))
+			dev = viper.device_list;
+		stripe->queue_depth = vio->queue_depth;
+		/* A stripe waiting for entities could be waiting for the ones
+		 * an earlier stripe of the same frame holds */
+		stripe->timeout_ms = 0;
+
+		first = layout->units * i / stripes;
+		next = layout->units * (i + 1) / stripes;
+		top = first < layout->margin ? first : layout->margin;
+		bottom = layout->units - next;
+		if (bottom > layout->margin)
+			bottom = layout->margin;
+
+		stripe_surface(&src, src_surface,
+			       (first - top) * layout->unit_src,
+			       (next - first + top + bottom) * layout->unit_src,
+			       vio->stripe_src_offset[i]);
+		stripe_surface(&dst, dst_surface, first * layout->unit_dst,
+			       (next - first) * layout->unit_dst,
+			       vio->stripe_dst_offset[i]);
+		stripe->margin_top = top * layout->unit_dst;
+		stripe->margin_bottom = bottom * layout->unit_dst;
+		if (shvio_setup(stripe, &src, &dst, 0))
+			break;
+		vio->stripe_done[i] = false;
+		vio->active_stripes++;
+	}
+	return i;
+}
+
+/* Split the frame into horizontal stripes, each set up on its own pool
+ * handle so that they run on separate entity chains or devices.  Stripes
+ * overlap by the lines the scaler filters over, see stripe_layout, so the
+ * result is the same as for the whole frame.  Stripes don't wait for busy
+ * entities; when fewer stripes than asked for can be set up, the frame is
+ * split into as many as could.  Returns the number of stripes, or 0 if
+ * the frame is processed whole. */
+static int setup_stripes(SHVIO *vio,
+			 const struct ren_vid_surface *src_surface,
+			 const struct ren_vid_surface *dst_surface)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+	struct stripe_layout layout;
+	int stripes = vio->stripes;
+	int done;
+
+	if (!stripe_layout(src_surface, dst_surface, &layout))
+		return 0;
+	while (stripes > 1 && layout.units / stripes * layout.unit_dst <
+			MIN_STRIPE_LINES)
+		stripes--;
+	if (stripes < 2)
+		return 0;
+
+	if (jobs_queued(vio, __FUNCTION__))
+		return -1;
+	if (pipe) {
+		set_pipeline(vio, NULL);
+		release_pipeline(vio->device, pipe);
+	}
+
+	while (stripes > 1) {
+		vio->active_stripes = 0;
+		done = try_stripes(vio, stripes, &layout, src_surface,
+				   dst_surface);
+		if (done == stripes) {
+			release_stripes(vio, stripes);
+			vio->stripes_asked = vio->stripes;
+			vio->stripe_src = *src_surface;
+			vio->stripe_dst = *dst_surface;
+			return stripes;
+		}
+		release_stripes(vio, 0);
+		if (done < 0)
+			return -1;
+		stripes = done;
+	}
+	return 0;
+}
+
+static bool same_geometry(const struct ren_vid_surface *a,
+			  const struct ren_vid_surface *b)
+{
+	return a->format == b->format && a->w == b->w && a->h == b->h &&
+		a->pitch == b->pitch && a->bpitchy == b->bpitchy &&
+		a->bpitchc == b->bpitchc;
+}
+
+/* The active stripes are laid out for a frame of the same geometry, so
+ * only the addresses have to be passed on to them */
+static bool same_stripe_frame(SHVIO *vio,
+			      const struct ren_vid_surface *src_surface,
+			      const struct ren_vid_surface *dst_surface)
+{
+	return vio->active_stripes && vio->stripes == vio->stripes_asked &&
+		same_geometry(src_surface, &vio->stripe_src) &&
+		same_geometry(dst_surface, &vio->stripe_dst);
+}
+
+/* Output lines of a bundle of 'lines' input lines, kept to whole chroma
+ * lines of the destination */
+static int bundle_output_lines(SHVIO *vio, int lines)
+{
+	int out = lines * vio->wpf_set.height / vio->rpf_set.height;
+	return out & ~(vert_increment(vio->dst_format) - 1);
+}
+
+/* The entity configs for bundles of 'lines' input lines of the frame set
+ * up by shvio_setup */
+static int bundle_config(SHVIO *vio, int lines, int *caps, void **args,
+			 struct viper_rpf_config *rpf_set,
+			 struct viper_uds_config *uds_set,
+			 struct viper_wpf_config *wpf_set)
+{
+	int count = 0;
+
+	*rpf_set = vio->rpf_set;
+	*uds_set = vio->uds_set;
+	*wpf_set = vio->wpf_set;
+	rpf_set->height = lines;
+	wpf_set->height = bundle_output_lines(vio, lines);
+
+	caps[count] = VIPER_CAPS_INPUT;
+	args[count++] = rpf_set;
+	if (vio->resize) {
+		uds_set->in_height = rpf_set->height;
+		uds_set->out_height = wpf_set->height;
+		caps[count] = VIPER_CAPS_RESIZE;
+		args[count++] = uds_set;
+	}
+	caps[count] = VIPER_CAPS_OUTPUT;
+	args[count++] = wpf_set;
+	return count;
+}
+
 int shvio_setup(SHVIO *vio,
 	const struct ren_vid_surface *src_surface,
         const struct ren_vid_surface *dst_surface,
         shvio_rotation_t rotate) {
 	struct viper_pipeline *pipeline;
+	struct viper_rpf_config rpf_set;
+	struct viper_uds_config uds_set;
+	struct viper_wpf_config wpf_set;
 	int caps[3];
 	void *args[3];
 	int num_ents = 0;
 	const struct vio_format *fmt;
 	int input_planes, output_planes;
-
-	struct viper_device *device = vio->device;
+	int stripes;
+
+	/* Striped frames of one geometry can follow each other while earlier
+	 * ones are still queued */
+	if (!rotate && same_stripe_frame(vio, src_surface, dst_surface)) {
+		shvio_set_src(vio, src_surface->py, src_surface->pc);
+		shvio_set_dst(vio, dst_surface->py, dst_surface->pc);
+		return 0;
+	}
+	if (stripe_jobs_queued(vio, __FUNCTION__))
+		return -1;
+	if (vio->stripes > 1 && !rotate) {
+		stripes = setup_stripes(vio, src_surface, dst_surface);
+		if (stripes)
+			return stripes < 0 ? -1 : 0;
+	}
+	release_stripes(vio, 0);
 
 	input_planes = setup_rpf(&vio->rpf_set, src_surface,
 		src_surface->format);
@@ -258,12 +1014,19 @@ int shvio_setup(SHVIO *vio,
 	num_ents++;
 	output_planes = setup_wpf(&vio->wpf_set, dst_surface,
 		src_surface->format);
-
-	if (is_resize(src_surface, dst_surface)) {
+	vio->wpf_set.margin_top = vio->margin_top;
+	vio->wpf_set.margin_bottom = vio->margin_bottom;
+
+	vio->src_format = src_surface->format;
+	vio->dst_format = dst_surface->format;
+	vio->resize = is_resize(src_surface, dst_surface,
+				vio->margin_top + vio->margin_bottom);
+	if (vio->resize) {
 		vio->uds_set.in_width = vio->rpf_set.width;
 		vio->uds_set.in_height = vio->rpf_set.height;
 		vio->uds_set.out_width = vio->wpf_set.width;
-		vio->uds_set.out_height = vio->wpf_set.height;
+		vio->uds_set.out_height = vio->wpf_set.height +
+			vio->margin_top + vio->margin_bottom;
 		vio->uds_set.code = vio->rpf_set.out_code;
 		caps[num_ents] = VIPER_CAPS_RESIZE;
 		args[num_ents] = &vio->uds_set;
@@ -273,82 +1036,134 @@ int shvio_setup(SHVIO *vio,
 	args[num_ents] = &vio->wpf_set;
 	num_ents++;
 
-	pipeline = create_pipeline(device, caps, args, num_ents);
+	/* A handle doing bundles gets its pipeline set up for them, so that
+	 * every frame doesn't start with a reconfiguration */
+	if (vio->bundle_hw_lines &&
+			vio->bundle_hw_lines <= vio->rpf_set.height) {
+		num_ents = bundle_config(vio, vio->bundle_hw_lines, caps, args,
+					 &rpf_set, &uds_set, &wpf_set);
+		pipeline = acquire_pipeline(vio, caps, args, num_ents);
+	} else {
+		pipeline = acquire_pipeline(vio, caps, args, num_ents);
+		vio->bundle_hw_lines = 0;
+	}
 
 	if (!pipeline) {
 		viper_log("%s: pipeline config failed\n", __FUNCTION__);
 		return -1;
 	}
 
-	pipeline->input_planes[0] = input_planes;
-
-	if (start_io_device(pipeline->input_fds[0], true)) {
-		viper_log("%s: cannot start input device\n", __FUNCTION__);
+	if (start_pipeline(pipeline)) {
+		viper_log("%s: cannot start pipeline\n", __FUNCTION__);
 		goto err_out;
 	}
-	pipeline->input_addr[0][0] = src_surface->py;
+
+	if (queue_full(vio, pipeline)) {
+		viper_log("%s: %d jobs already queued\n", __FUNCTION__,
+			pipeline->queued);
+		set_pipeline(vio, pipeline);
+		return -1;
+	}
+
+	pipeline->input_planes[0] = input_planes;
+	set_input_addr(pipeline, 0, src_surface->py, src_surface->pc);
 	pipeline->input_size[0][0] = src_surface->h *
 		size_y(src_surface->format, src_surface->pitch, 0);
 
 	if (input_planes > 1) {
-		pipeline->input_addr[0][1] = src_surface->pc;
 		pipeline->input_size[0][1] = src_surface->h *
 			size_c(src_surface->format, src_surface->pitch, 0);
 	}
 
 	pipeline->output_planes[0] = output_planes;
-
-	if (start_io_device(pipeline->output_fds[0], false)) {
-		viper_log("%s: cannot start output device\n", __FUNCTION__);
-		goto err_out;
-	}
-
-	pipeline->output_addr[0][0] = dst_surface->py;
+	set_output_addr(pipeline, 0, dst_surface->py, dst_surface->pc);
 	pipeline->output_size[0][0] = dst_surface->h *
 		size_y(dst_surface->format, dst_surface->pitch, 0);
 
 	if (output_planes > 1) {
-		pipeline->output_addr[0][1] = dst_surface->pc;
 		pipeline->output_size[0][1] = dst_surface->h *
 			size_c(dst_surface->format, dst_surface->pitch, 0);
 	}
-	vio->bundle_lines_remaining = src_surface->h;
-	vio->bundle_lines = vio->bundle_lines_remaining;
-	vio->pipeline = pipeline;
+	vio->input_lines_done = 0;
+	vio->output_lines_done = 0;
+	set_pipeline(vio, pipeline);
 	return 0;
 
 err_out:
-	free_pipeline(device, pipeline);
+	set_pipeline(vio, NULL);
+	free_pipeline(vio->device, pipeline);
 	return -1;
 }
-int
-shvio_setup_blend(
-	SHVIO *vio,
-	const struct ren_vid_rect *virt,
-	const struct ren_vid_surface *const *src_list,
-	int src_count,
-	const struct ren_vid_surface *dst)
+/* Keep the held pipeline if it differs from the blend config only in
+ * where the layers are placed, moving them with a restart of its queues.
+ * The bru selection shadow limits that to the rectangles that moved. */
+static bool move_blend_layers(SHVIO *vio, struct viper_pipeline *pipe,
+			      int *caps, void **args, int count)
 {
+	if (!pipeline_fits(pipe, caps, args, count))
+		return false;
+	if (pipeline_matches(pipe, caps, args, count))
+		return true;
+
+	/* Jobs already queued were set up with the old placement, and the
+	 * restart would drop them: they have to be waited for first */
+	if (jobs_queued(vio, __FUNCTION__))
+		return false;
+	if (update_pipeline(pipe, args)) {
+		viper_log("%s: cannot move layers\n", __FUNCTION__);
+		set_pipeline(vio, NULL);
+		free_pipeline(vio->device, pipe);
+		return false;
+	}
+	return true;
+}
 
-	int i, ret = 0;
+static int layer_alpha(const struct ren_vid_surface *src)
+{
+	if (src->flags & BLEND_GLOBAL_ALPHA)
+		return (src->flags & BLEND_ALPHA_MASK) >> BLEND_ALPHA_SHIFT;
+	return 255;
+}
+
+/* Set up one bru pass over at most BRU_MAX_INPUTS layers */
+static int setup_blend_pass(SHVIO *vio, const struct ren_vid_rect *virt,
+			    const struct ren_vid_surface *const *src_list,
+			    int src_count, const struct ren_vid_surface *dst,
+			    uint32_t bg_color)
+{
+	int i;
 	struct viper_rpf_config *rpf_set;
-	struct viper_bru_config *bru_set;
+	struct viper_bru_config *bru_set = &vio->blend_bru;
 	struct viper_uds_config *uds_set;
 	struct viper_wpf_config wpf_set;
-	int *input_planes, *caps;
-	void **args;
+	int input_planes[BRU_MAX_INPUTS];
+	int caps[MAX_PIPELINE_ENTITIES];
+	void *args[MAX_PIPELINE_ENTITIES];
 	int output_planes;
 	int num_ents = 0;
 	struct viper_pipeline *pipeline;
-	struct viper_device *device = vio->device;
 
-	bru_set = calloc(1, sizeof (struct viper_bru_config));
-	input_planes = calloc(src_count, sizeof (int));
-	caps = calloc(src_count * 2 + 2, sizeof (int));
-	args = calloc(src_count * 2 + 2, sizeof (void *));
+	if (src_count < 1 || src_count > BRU_MAX_INPUTS) {
+		viper_log("%s: %d sources, at most %d supported\n",
+			__FUNCTION__, src_count, BRU_MAX_INPUTS);
+		return -1;
+	}
+
+	/* Blends and fills are not striped, see shvio_setup */
+	if (stripe_jobs_queued(vio, __FUNCTION__))
+		return -1;
+	release_stripes(vio, 0);
+
+	/* The configs are compared whole by the pipeline cache */
+	memset(bru_set, 0, sizeof(*bru_set));
+	bru_set->bg_color = bg_color;
 	for (i = 0; i < src_count; i++) {
-		rpf_set = calloc(1, sizeof (struct viper_rpf_config));
-		input_planes[i] = setup_rpf(rpf_set, src_list[i], dst->format);		
+		rpf_set = &vio->blend_rpf[i];
+		memset(rpf_set, 0, sizeof(*rpf_set));
+		input_planes[i] = setup_rpf(rpf_set, src_list[i], dst->format);
+		rpf_set->premultiplied = ((src_list[i]->flags & BLEND_MODE_MASK)
+					  == BLEND_MODE_PREMULT);
+		rpf_set->alpha = layer_alpha(src_list[i]);
 		caps[num_ents] = VIPER_CAPS_INPUT;
 		args[num_ents] = rpf_set;
 		bru_set->in_lefts[i] = src_list[i]->blend_out.x;
@@ -358,7 +1173,8 @@ shvio_setup_blend(
 		num_ents++;
 		
 		if (is_resize_rect(src_list[i])) {
-			uds_set = calloc(1, sizeof (struct viper_bru_config));
+			uds_set = &vio->blend_uds[i];
+			memset(uds_set, 0, sizeof(*uds_set));
 			uds_set->in_width = src_list[i]->w;
 			uds_set->in_height = src_list[i]->h;
 			uds_set->out_width = src_list[i]->blend_out.w;
@@ -378,6 +1194,7 @@ shvio_setup_blend(
 	args[num_ents] = bru_set;
 	num_ents++;
 	
+	memset(&wpf_set, 0, sizeof(wpf_set));
 	output_planes = setup_wpf(&wpf_set, dst, dst->format);
 	wpf_set.width = bru_set->out_width;
 	wpf_set.height = bru_set->out_height;
@@ -391,65 +1208,479 @@ shvio_setup_blend(
 
 	bru_set->code = wpf_set.in_code;
 
-	pipeline = create_pipeline(device, caps, args, num_ents);
+	/* Layers that only moved keep the pipeline; anything else goes
+	 * through the pipeline cache, which also moves the layers of a
+	 * cached pipeline rather than build a new one */
+	pipeline = vio->pipeline;
+	if (!pipeline || !move_blend_layers(vio, pipeline, caps, args,
+					    num_ents))
+		pipeline = acquire_pipeline(vio, caps, args, num_ents);
+	vio->bundle_hw_lines = 0;
 
 	if (!pipeline) {
 		viper_log("%s: pipeline config failed\n", __FUNCTION__);
-		ret = -1;
-		goto end;
+		return -1;
+	}
+
+	if (start_pipeline(pipeline)) {
+		viper_log("%s: cannot start pipeline\n", __FUNCTION__);
+		set_pipeline(vio, NULL);
+		free_pipeline(vio->device, pipeline);
+		return -1;
+	}
+
+	if (queue_full(vio, pipeline)) {
+		viper_log("%s: %d jobs already queued\n", __FUNCTION__,
+			pipeline->queued);
+		set_pipeline(vio, pipeline);
+		return -1;
 	}
 
 	memcpy(pipeline->input_planes, input_planes, src_count * sizeof(int));
 	for (i = 0; i < src_count; i++) {
-		if (start_io_device(pipeline->input_fds[i], true)) {
-			viper_log("%s: cannot start input device\n",
-							__FUNCTION__);
-			ret = -1;
-			free_pipeline(device, pipeline);
-			goto end;
-		}
-		pipeline->input_addr[i][0] = src_list[i]->py;
+		set_input_addr(pipeline, i, src_list[i]->py, src_list[i]->pc);
 		pipeline->input_size[i][0] = src_list[i]->h *
 			size_y(src_list[i]->format, src_list[i]->pitch, 0);
 
-		if (input_planes > 1) {
-			pipeline->input_addr[i][1] = src_list[i]->pc;
+		if (input_planes[i] > 1) {
 			pipeline->input_size[i][1] = src_list[i]->h *
 			    size_c(src_list[i]->format, src_list[i]->pitch, 0);
 		}
 	}
 
 	pipeline->output_planes[0] = output_planes;
+	set_output_addr(pipeline, 0, dst->py, dst->pc);
+	pipeline->output_size[0][0] = wpf_set.height * wpf_set.bpitch0;
+
+	if (output_planes > 1)
+		pipeline->output_size[0][1] = wpf_set.height * wpf_set.bpitch1;
+	
+	set_pipeline(vio, pipeline);
+	return 0;
+}
+
+/* Set up a pass filling the destination with the background colour.  The
+ * bru still needs an input for the pipeline to run, so a few pixels of
+ * the destination are read back with a global alpha of 0 and don't
+ * show. */
+static int setup_background(SHVIO *vio, const struct ren_vid_surface *dst,
+			    uint32_t bg_color)
+{
+	struct ren_vid_surface src;
+	const struct ren_vid_surface *src_list[1] = { &src };
+
+	memset(&src, 0, sizeof(src));
+	src.format = REN_RGB565;
+	src.w = src.h = src.pitch = 2;
+	src.py = dst->py;
+	src.flags = BLEND_ALPHA(0);
+	return setup_blend_pass(vio, NULL, src_list, 1, dst, bg_color);
+}
+
+static void layer_rect(const struct ren_vid_surface *src,
+		       struct ren_vid_rect *rect)
+{
+	rect->x = src->blend_out.x;
+	rect->y = src->blend_out.y;
+	rect->w = src->blend_out.w ? src->blend_out.w : src->w;
+	rect->h = src->blend_out.h ? src->blend_out.h : src->h;
+}
+
+/* A layer is skipped if it lies outside the output, or if an opaque
+ * layer above it covers it completely */
+static bool layer_visible(const struct ren_vid_surface *const *src_list,
+			  int src_count, int idx, int out_w, int out_h)
+{
+	struct ren_vid_rect r, top;
+	int i;
 
-	if (start_io_device(pipeline->output_fds[0], false)) {
-		viper_log("%s: cannot start output device\n", __FUNCTION__);
-		free_pipeline(device, pipeline);
-		ret = -1;
-		goto end;
+	layer_rect(src_list[idx], &r);
+	if (r.w <= 0 || r.h <= 0 || r.x >= out_w || r.y >= out_h ||
+			r.x + r.w <= 0 || r.y + r.h <= 0)
+		return false;
+
+	for (i = idx + 1; i < src_count; i++) {
+		if (has_alpha(src_list[i]->format) ||
+				layer_alpha(src_list[i]) != 255)
+			continue;
+		layer_rect(src_list[i], &top);
+		if (top.x <= r.x && top.y <= r.y &&
+				top.x + top.w >= r.x + r.w &&
+				top.y + top.h >= r.y + r.h)
+			return false;
 	}
+	return true;
+}
 
-	pipeline->output_addr[0][0] = dst->py;
-	pipeline->output_size[0][0] = wpf_set.height * wpf_set.bpitch0;
+/* The result of a pass, read back as the bottom layer of the next one */
+static void pass_surface(struct ren_vid_surface *out,
+			 const struct ren_vid_surface *in,
+			 const struct ren_vid_rect *virt, int w, int h)
+{
+	*out = *in;
+	out->w = w;
+	out->h = h;
+	if (virt) {
+		out->pitch = virt->w;
+		out->bpitchy = out->bpitchc = 0;
+	}
+	memset(&out->blend_out, 0, sizeof(out->blend_out));
+	out->flags = 0;
+}
 
-	if (output_planes > 1) {
-		pipeline->input_addr[0][1] = dst->pc;
-		pipeline->input_size[0][1] = wpf_set.height * wpf_set.bpitch1;
+/* More layers than the bru has inputs are blended in several passes.
+ * Each pass but the last is run here, and adds BRU_MAX_INPUTS - 1 layers
+ * on top of the result of the pass before, read back as its bottom layer.
+ * With a scratch surface the passes alternate between it and the
+ * destination, ending on the destination, so no pass reads the buffer it
+ * writes.  Without one the destination is read back while the pass
+ * writes it.  That relies on each output line depending only on the same
+ * line of the bottom layer, which the RPF reads before the WPF can write
+ * it: the bottom layer is unscaled at the origin, in the destination's
+ * own format and layout.  YCbCr formats read and write chroma for pairs
+ * of lines, so that is only done for RGB destinations. */
+int
+shvio_setup_blend(
+	SHVIO *vio,
+	const struct ren_vid_rect *virt,
+	const struct ren_vid_surface *const *src_list,
+	int src_count,
+	const struct ren_vid_surface *dst)
+{
+	const struct ren_vid_surface *pass[BRU_MAX_INPUTS];
+	struct ren_vid_surface back, scratch;
+	const struct ren_vid_surface *out;
+	int out_w = virt ? virt->w : dst->w;
+	int out_h = virt ? virt->h : dst->h;
+	int i, n = 0, visible = 0, passes;
+
+	for (i = 0; i < src_count; i++) {
+		if (layer_visible(src_list, src_count, i, out_w, out_h))
+			visible++;
 	}
-	
-	vio->pipeline = pipeline;
-end:
-	for (i = 0; i < num_ents - 1; i++)
-		free(args[i]);
-	free(args);
-	free(caps);
-	free(input_planes);
-	return ret;
+	/* Nothing to show, but still write the output */
+	if (!visible && src_count)
+		return setup_blend_pass(vio, virt, &src_list[src_count - 1],
+					1, dst, 0);
+
+	passes = 1 + (visible - 2) / (BRU_MAX_INPUTS - 1);
+	if (passes > 1) {
+		if (jobs_queued(vio, __FUNCTION__))
+			return -1;
+		if (vio->blend_scratch.py) {
+			if (vio->blend_scratch.w < out_w ||
+					vio->blend_scratch.h < out_h) {
+				viper_log("%s: scratch surface too small\n",
+					__FUNCTION__);
+				return -1;
+			}
+			pass_surface(&scratch, &vio->blend_scratch, NULL,
+				     out_w, out_h);
+		} else if (!is_rgb(dst->format)) {
+			viper_log("%s: %d layers need a scratch surface\n",
+				__FUNCTION__, visible);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < src_count; i++) {
+		if (!layer_visible(src_list, src_count, i, out_w, out_h))
+			continue;
+		pass[n++] = src_list[i];
+		if (--visible && n == BRU_MAX_INPUTS) {
+			/* The last pass writes the destination */
+			out = dst;
+			if (vio->blend_scratch.py && --passes % 2)
+				out = &scratch;
+			if (setup_blend_pass(vio, out == dst ? virt : NULL,
+					     pass, n, out, 0) ||
+					shvio_submit(vio) ||
+					shvio_wait(vio) < 0)
+				return -1;
+			pass_surface(&back, out, out == dst ? virt : NULL,
+				     out_w, out_h);
+			n = 0;
+			pass[n++] = &back;
+		}
+	}
+	return setup_blend_pass(vio, virt, pass, n, dst, 0);
+}
+
+/* Crop a layer to the part of it inside 'area', placed relative to the
+ * area.  The crop of an unscaled layer may reach out of the area, see
+ * setup_damage_area.  Returns false if the layer doesn't reach into the
+ * area. */
+static bool damage_layer(const struct ren_vid_surface *src,
+			 const struct ren_vid_rect *area,
+			 struct ren_vid_surface *out)
+{
+	struct ren_vid_rect r, sel;
+	int hi = horz_increment(src->format);
+	int vi = vert_increment(src->format);
+	int x0, y0, x1, y1;
+
+	layer_rect(src, &r);
+	x0 = r.x > area->x ? r.x : area->x;
+	y0 = r.y > area->y ? r.y : area->y;
+	x1 = r.x + r.w < area->x + area->w ? r.x + r.w : area->x + area->w;
+	y1 = r.y + r.h < area->y + area->h ? r.y + r.h : area->y + area->h;
+	if (x0 >= x1 || y0 >= y1)
+		return false;
+
+	if (is_resize_rect(src)) {
+		/* Source lines and columns under the area, rounded out to
+		 * whole chroma samples; the scaler covers the difference */
+		sel.x = ((x0 - r.x) * src->w / r.w) & ~(hi - 1);
+		sel.y = ((y0 - r.y) * src->h / r.h) & ~(vi - 1);
+		sel.w = ((x1 - r.x) * src->w + r.w - 1) / r.w;
+		sel.h = ((y1 - r.y) * src->h + r.h - 1) / r.h;
+		sel.w = ((sel.w + hi - 1) & ~(hi - 1)) - sel.x;
+		sel.h = ((sel.h + vi - 1) & ~(vi - 1)) - sel.y;
+		if (sel.x + sel.w > src->w)
+			sel.w = src->w - sel.x;
+		if (sel.y + sel.h > src->h)
+			sel.h = src->h - sel.y;
+		get_sel_surface(out, src, &sel);
+		out->blend_out.x = x0 - area->x;
+		out->blend_out.y = y0 - area->y;
+		out->blend_out.w = x1 - x0;
+		out->blend_out.h = y1 - y0;
+	} else {
+		/* Rounded out to whole chroma samples, so that no part of
+		 * the area is left to the background */
+		sel.x = (x0 - r.x) & ~(hi - 1);
+		sel.y = (y0 - r.y) & ~(vi - 1);
+		sel.w = ((x1 - r.x + hi - 1) & ~(hi - 1)) - sel.x;
+		sel.h = ((y1 - r.y + vi - 1) & ~(vi - 1)) - sel.y;
+		if (sel.x + sel.w > src->w)
+			sel.w = src->w - sel.x;
+		if (sel.y + sel.h > src->h)
+			sel.h = src->h - sel.y;
+		get_sel_surface(out, src, &sel);
+		out->blend_out.x = r.x + sel.x - area->x;
+		out->blend_out.y = r.y + sel.y - area->y;
+		out->blend_out.w = out->w;
+		out->blend_out.h = out->h;
+	}
+	return out->w > 0 && out->h > 0;
+}
+
+/* Clip a damaged rectangle to the output, rounded out to whole chroma
+ * samples of it.  Returns false if nothing is left. */
+static bool damage_area(const struct ren_vid_rect *damage,
+			const struct ren_vid_surface *dst,
+			struct ren_vid_rect *area)
+{
+	int hi = horz_increment(dst->format);
+	int vi = vert_increment(dst->format);
+	int x2, y2;
+
+	area->x = damage->x > 0 ? damage->x & ~(hi - 1) : 0;
+	area->y = damage->y > 0 ? damage->y & ~(vi - 1) : 0;
+	x2 = (damage->x + damage->w + hi - 1) & ~(hi - 1);
+	y2 = (damage->y + damage->h + vi - 1) & ~(vi - 1);
+	if (x2 > dst->w)
+		x2 = dst->w;
+	if (y2 > dst->h)
+		y2 = dst->h;
+	area->w = x2 - area->x;
+	area->h = y2 - area->y;
+	return area->w > 0 && area->h > 0;
+}
+
+/* Set up a blend of the layers over 'area' of the destination only.  When
+ * the crop of a layer reaches out of the area, the area grows to take it
+ * in; if that keeps spilling over, the whole output is blended. */
+static int setup_damage_area(SHVIO *vio,
+			     const struct ren_vid_surface *const *src_list,
+			     int src_count, const struct ren_vid_surface *dst,
+			     const struct ren_vid_rect *area)
+{
+	struct ren_vid_surface out, *layer;
+	struct ren_vid_rect cur = *area, grown;
+	int i, n, tries, x2, y2;
+
+	if (vio->damage_size < src_count) {
+		struct ren_vid_surface *layers;
+		const struct ren_vid_surface **list;
+		layers = realloc(vio->damage_layers,
+				 src_count * sizeof(*layers));
+		if (layers)
+			vio->damage_layers = layers;
+		list = realloc(vio->damage_list, src_count * sizeof(*list));
+		if (list)
+			vio->damage_list = list;
+		if (!layers || !list)
+			return -1;
+		vio->damage_size = src_count;
+	}
+
+	for (tries = 0; ; tries++) {
+		grown = cur;
+		x2 = cur.x + cur.w;
+		y2 = cur.y + cur.h;
+		for (i = n = 0; i < src_count; i++) {
+			layer = &vio->damage_layers[n];
+			if (!damage_layer(src_list[i], &cur, layer))
+				continue;
+			vio->damage_list[n++] = layer;
+			if (cur.x + layer->blend_out.x < grown.x)
+				grown.x = cur.x + layer->blend_out.x;
+			if (cur.y + layer->blend_out.y < grown.y)
+				grown.y = cur.y + layer->blend_out.y;
+			if (cur.x + layer->blend_out.x + layer->blend_out.w > x2)
+				x2 = cur.x + layer->blend_out.x +
+					layer->blend_out.w;
+			if (cur.y + layer->blend_out.y + layer->blend_out.h > y2)
+				y2 = cur.y + layer->blend_out.y +
+					layer->blend_out.h;
+		}
+		grown.w = x2 - grown.x;
+		grown.h = y2 - grown.y;
+		if (!memcmp(&grown, &cur, sizeof(cur)))
+			break;
+		if (tries == 2 || !damage_area(&grown, dst, &cur))
+			return shvio_setup_blend(vio, NULL, src_list,
+						 src_count, dst);
+	}
+
+	get_sel_surface(&out, dst, &cur);
+	/* No layer there, only the background */
+	if (!n)
+		return setup_background(vio, &out, 0);
+	return shvio_setup_blend(vio, NULL, vio->damage_list, n, &out);
+}
+
+/* Damaged areas far apart are blended one by one, anything else as the
+ * rectangle that bounds them */
+int
+shvio_setup_blend_damage(
+	SHVIO *vio,
+	const struct ren_vid_rect *virt,
+	const struct ren_vid_surface *const *src_list,
+	int src_count,
+	const struct ren_vid_surface *dst,
+	const struct ren_vid_rect *damage,
+	int damage_count)
+{
+	struct ren_vid_surface full = *dst;
+	struct ren_vid_rect area, next, bound;
+	int i, x2, y2, n = 0;
+	long covered = 0;
+
+	/* The output is the virtual surface, at the destination addresses */
+	if (virt) {
+		full.w = virt->w;
+		full.h = virt->h;
+		full.pitch = virt->w;
+		full.bpitchy = full.bpitchc = 0;
+	}
+
+	for (i = 0; i < damage_count; i++) {
+		/* Clipped to the output, rounded out to whole chroma samples */
+		if (!damage_area(&damage[i], &full, &area))
+			continue;
+		x2 = area.x + area.w;
+		y2 = area.y + area.h;
+		if (!n++) {
+			bound = area;
+		} else {
+			if (x2 > bound.x + bound.w)
+				bound.w = x2 - bound.x;
+			if (y2 > bound.y + bound.h)
+				bound.h = y2 - bound.y;
+			if (area.x < bound.x) {
+				bound.w += bound.x - area.x;
+				bound.x = area.x;
+			}
+			if (area.y < bound.y) {
+				bound.h += bound.y - area.y;
+				bound.y = area.y;
+			}
+		}
+		covered += (long)area.w * area.h;
+	}
+	if (!n)
+		return shvio_setup_blend(vio, virt, src_list, src_count, dst);
+
+	if (n == 1 || covered * 2 >= (long)bound.w * bound.h)
+		return setup_damage_area(vio, src_list, src_count, &full,
+					 &bound);
+
+	/* One pass per area; all but the last run here, in order */
+	if (jobs_queued(vio, __FUNCTION__))
+		return -1;
+	n = 0;
+	for (i = 0; i < damage_count; i++) {
+		if (!damage_area(&damage[i], &full, &next))
+			continue;
+		if (n++ && (setup_damage_area(vio, src_list, src_count, &full,
+					      &area) ||
+			    shvio_submit(vio) || shvio_wait(vio) < 0))
+			return -1;
+		area = next;
+	}
+	return setup_damage_area(vio, src_list, src_count, &full, &area);
+}
+
+int
+shvio_blend(
+	SHVIO *vio,
+	const struct ren_vid_surface *const *src_list,
+	int src_count,
+	const struct ren_vid_surface *dst)
+{
+	if (handle_busy(vio, __FUNCTION__))
+		return -1;
+	if (shvio_setup_blend(vio, NULL, src_list, src_count, dst))
+		return -1;
+	if (shvio_submit(vio))
+		return -1;
+	return shvio_wait(vio) < 0 ? -1 : 0;
+}
+
+/* BT.601 limited range, as the bru takes its background colour in the
+ * colour space of the pipeline */
+static uint32_t argb_to_ayuv(uint32_t argb)
+{
+	int r = (argb >> 16) & 0xff;
+	int g = (argb >> 8) & 0xff;
+	int b = argb & 0xff;
+	int y = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+	int u = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+	int v = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+
+	return (argb & 0xff000000) | (y << 16) | (u << 8) | v;
+}
+
+/* The bru fills its output with the background colour, see
+ * setup_background */
+int
+shvio_fill(
+	SHVIO *vio,
+	const struct ren_vid_surface *dst_surface,
+	uint32_t argb)
+{
+	uint32_t color = argb & 0xffffff;
+
+	if (handle_busy(vio, __FUNCTION__))
+		return -1;
+	if (is_ycbcr(dst_surface->format))
+		color = argb_to_ayuv(argb) & 0xffffff;
+
+	if (setup_background(vio, dst_surface, color))
+		return -1;
+	if (shvio_submit(vio))
+		return -1;
+	return shvio_wait(vio) < 0 ? -1 : 0;
 }
 
 int shvio_rotate(SHVIO *vio,
 	const struct ren_vid_surface *src_surface,
         const struct ren_vid_surface *dst_surface,
         shvio_rotation_t rotate) {
+	if (handle_busy(vio, __FUNCTION__))
+		return -1;
 	shvio_setup(vio,src_surface,dst_surface,rotate);
 	shvio_start(vio);
 	shvio_wait(vio);
@@ -459,161 +1690,496 @@ int shvio_rotate(SHVIO *vio,
 int shvio_resize(SHVIO *vio,
 	const struct ren_vid_surface *src_surface,
         const struct ren_vid_surface *dst_surface) {
+	if (handle_busy(vio, __FUNCTION__))
+		return -1;
 	shvio_setup(vio,src_surface,dst_surface,0);
 	shvio_start(vio);
 	shvio_wait(vio);
 	return 0;
 }
 
-void shvio_start(SHVIO *vio)
+int shvio_submit(SHVIO *vio)
 {
 	struct viper_pipeline *pipe = vio->pipeline;
-	int i;
-	int ret;
+	int i, index;
+
+	if (vio->active_stripes) {
+		for (i = 0; i < vio->active_stripes; i++) {
+			pipe = vio->stripe_vio[i]->pipeline;
+			if (!pipe || queue_full(vio->stripe_vio[i], pipe)) {
+				viper_log("%s: stripe %d cannot queue\n",
+					__FUNCTION__, i);
+				return -1;
+			}
+		}
+		for (i = 0; i < vio->active_stripes; i++) {
+			if (shvio_submit(vio->stripe_vio[i]))
+				break;
+		}
+		if (i == vio->active_stripes)
+			return 0;
+		/* The stripes already queued can't take their job back, and
+		 * their older jobs are still to be waited for */
+		while (i--)
+			drop_last_job(vio->stripe_vio[i]);
+		return -1;
+	}
 
 	if (!pipe)
-		return;
+		return -1;
+
+	if (queue_full(vio, pipe)) {
+		viper_log("%s: %d jobs already queued\n", __FUNCTION__,
+			pipe->queued);
+		return -1;
+	}
+
+	/* Back from bundles to whole frames */
+	if (vio->bundle_hw_lines) {
+		int caps[3];
+		void *args[3];
+		int count = 0;
+		if (pipe->queued) {
+			viper_log("%s: bundles still queued\n", __FUNCTION__);
+			return -1;
+		}
+		caps[count] = VIPER_CAPS_INPUT;
+		args[count++] = &vio->rpf_set;
+		if (vio->resize) {
+			caps[count] = VIPER_CAPS_RESIZE;
+			args[count++] = &vio->uds_set;
+		}
+		caps[count] = VIPER_CAPS_OUTPUT;
+		args[count++] = &vio->wpf_set;
+		stop_pipeline(pipe);
+		if (reconfig_pipeline(pipe, caps, args, count))
+			return -1;
+		vio->bundle_hw_lines = 0;
+	}
+
+	if (start_pipeline(pipe) || sync_pipeline_memory(pipe))
+		return -1;
 
-	ret = 0;
 	for (i = 0; i < pipe->num_inputs; i++) {
-		ret |= queue_buffer(pipe->input_fds[i], pipe->input_addr[i],
-			pipe->input_size[i], pipe->input_planes[i], true);
-		if (ret)
+		index = pipe->input_memory[i] == V4L2_MEMORY_MMAP ?
+			pipe->input_index[i] : pipe->next_index;
+		if (queue_buffer(pipe->input_fds[i], index,
+				pipe->input_memory[i], pipe->input_addr[i],
+				pipe->input_dmabuf[i], pipe->input_size[i],
+				pipe->input_planes[i], true)) {
 			viper_log("%s: queue input buffer fail. %d\n",
 				__FUNCTION__, errno);
+			goto err_out;
+		}
 	}
 
-	ret = 0;
 	for (i = 0; i < pipe->num_outputs; i++) {
-		ret |= queue_buffer(pipe->output_fds[i], pipe->output_addr[i],
-			pipe->output_size[i], pipe->input_planes[i], false);
-		if (ret)
+		index = pipe->output_memory[i] == V4L2_MEMORY_MMAP ?
+			pipe->output_index[i] : pipe->next_index;
+		if (queue_buffer(pipe->output_fds[i], index,
+				pipe->output_memory[i], pipe->output_addr[i],
+				pipe->output_dmabuf[i], pipe->output_size[i],
+				pipe->output_planes[i], false)) {
 			viper_log("%s: queue output buffer fail. %d\n",
 				__FUNCTION__, errno);
+			goto err_out;
+		}
 	}
+	pipe->next_index = (pipe->next_index + 1) % pipe->buffers;
+	pipeline_job_queued(pipe);
+	push_job(vio, vio->wpf_set.height, true, false);
+	return 0;
+
+err_out:
+	/* A partly queued job would never complete; drop everything queued
+	 * so far. The next submit restarts the queues. */
+	stop_pipeline(pipe);
+	vio->job_count = 0;
+	return -1;
+}
+
+void shvio_start(SHVIO *vio)
+{
+	shvio_submit(vio);
 }
 
-static int reconfig_pipeline(struct viper_pipeline *pipe,
-			     unsigned int *caps,
-			     void **args,
-			     int count)
+/* The short last bundle of a frame runs through a buffer of the handle:
+ * the source lines left are copied in and the last lines repeated to fill
+ * the bundle, and the destination lines left are copied out once done.
+ * Returns the buffer, of at least 'size' bytes, or NULL. */
+static char *tail_buffer(SHVIO *vio, size_t size)
 {
-	struct viper_entity *entity;
+	void *buf;
 	int i;
-	for (i = 0; i < count; i++) {
-		entity = pipe->locked_entities;
-		while(entity) {
-			if (entity->caps->caps == caps[i])
-				entity->caps->config(entity, args[i]);
 
-			entity = entity->next_locked;
+	if (vio->tail_buf_size >= size)
+		return vio->tail_buf;
+
+	for (i = 0; i < vio->job_count; i++) {
+		if (vio->jobs[(vio->job_head + i) % MAX_QUEUE_DEPTH].tail) {
+			viper_log("%s: last bundle of a frame still queued\n",
+				__FUNCTION__);
+			return NULL;
 		}
 	}
-	return 0;
+
+	if (posix_memalign(&buf, TAIL_BUF_ALIGN, size)) {
+		viper_log("%s: cannot allocate %zu bytes\n", __FUNCTION__,
+			size);
+		return NULL;
+	}
+	free(vio->tail_buf);
+	vio->tail_buf = buf;
+	vio->tail_buf_size = size;
+	return buf;
 }
 
-void shvio_start_bundle(SHVIO *vio, int bundle_lines)
+/* Copy the 'lines' source lines left into 'addr', and repeat the last
+ * whole chroma lines down to the end of the bundle, like the edge of the
+ * frame. */
+static void fill_tail_input(SHVIO *vio, void **addr, const int *size,
+			    int lines, int align)
 {
 	struct viper_pipeline *pipe = vio->pipeline;
+	int have[MAX_PLANES], block[MAX_PLANES];
+	int i, off;
+
+	plane_bytes(vio->src_format, vio->rpf_set.bpitch0,
+		    vio->rpf_set.bpitch1, lines, have);
+	plane_bytes(vio->src_format, vio->rpf_set.bpitch0,
+		    vio->rpf_set.bpitch1, align, block);
+	for (i = 0; i < pipe->input_planes[0]; i++) {
+		memcpy(addr[i], pipe->input_addr[0][i], have[i]);
+		if (have[i] < block[i])
+			continue;
+		for (off = have[i]; off < size[i]; off += block[i])
+			memcpy((char *)addr[i] + off,
+			       (char *)addr[i] + have[i] - block[i],
+			       size[i] - off < block[i] ?
+			       size[i] - off : block[i]);
+	}
+}
+
+int shvio_submit_bundle(SHVIO *vio, int bundle_lines)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+	struct viper_rpf_config rpf_set;
+	struct viper_uds_config uds_set;
+	struct viper_wpf_config wpf_set;
+	void *input_addr[MAX_PLANES], *output_addr[MAX_PLANES];
+	int input_size[MAX_PLANES], output_size[MAX_PLANES];
+	int tail_size[MAX_PLANES];
+	int input_remaining, output_remaining;
+	int wpf_lines, out_lines, align, unit, unit_out;
+	size_t in_bytes, out_bytes;
+	char *buf;
+	bool tail;
+
+	if (vio->active_stripes) {
+		viper_log("%s: not supported in stripe mode\n", __FUNCTION__);
+		return -1;
+	}
 	if (!pipe)
-		return;
+		return -1;
+	if (queue_full(vio, pipe)) {
+		viper_log("%s: queue full\n", __FUNCTION__);
+		return -1;
+	}
 
-	if (bundle_lines > vio->bundle_lines_remaining)
-		bundle_lines = vio->bundle_lines_remaining;
+	/* Bundles are addressed by offsetting the virtual addresses */
+	if (pipe->input_memory[0] != V4L2_MEMORY_USERPTR ||
+	    pipe->output_memory[0] != V4L2_MEMORY_USERPTR) {
+		viper_log("%s: bundle mode needs virtual addresses\n",
+			__FUNCTION__);
+		return -1;
+	}
 
-	if (bundle_lines != vio->bundle_lines) {
+	/* Bundles start and end on whole chroma lines, and take whole units
+	 * of the scaling ratio where there are any, so that every bundle
+	 * gives the same whole number of output lines */
+	align = vert_increment(vio->src_format);
+	if (vert_increment(vio->dst_format) > align)
+		align = vert_increment(vio->dst_format);
+	if (!scale_unit(vio->rpf_set.height, vio->wpf_set.height, align,
+			&unit, &unit_out))
+		unit = align;
+	bundle_lines -= bundle_lines % unit;
+	if (!bundle_lines)
+		bundle_lines = unit;
+	if (bundle_lines > vio->rpf_set.height)
+		bundle_lines = vio->rpf_set.height;
+
+	if (bundle_lines != vio->bundle_hw_lines) {
 		int caps[3];
 		void *args[3];
-		int pipe_count = 0;
-		int wpf_lines = bundle_lines * vio->wpf_set.height / vio->rpf_set.height;
-		const struct vio_format *fmt;
-		vio->rpf_set.height = bundle_lines;
-		vio->wpf_set.height = wpf_lines;
-		caps[pipe_count] = VIPER_CAPS_INPUT;
-		args[pipe_count] = &vio->rpf_set;
-		pipe_count++;
-		if (wpf_lines != bundle_lines) {
-			vio->uds_set.in_height = bundle_lines;
-			vio->uds_set.out_height = wpf_lines;
-			caps[pipe_count] = VIPER_CAPS_RESIZE;
-			args[pipe_count] = &vio->uds_set;
-			pipe_count++;
+		int count;
+		if (pipe->queued) {
+			viper_log("%s: bundle size changed with bundles queued\n",
+				__FUNCTION__);
+			return -1;
 		}
-		caps[pipe_count] = VIPER_CAPS_OUTPUT;
-		args[pipe_count] = &vio->wpf_set;
-		pipe_count++;
-		vio->bundle_lines = bundle_lines;
-
-		stop_io_device(pipe->input_fds[0], true);
-		stop_io_device(pipe->output_fds[0], false);
-		reconfig_pipeline(pipe, caps, args, pipe_count);
-		if(start_io_device(pipe->input_fds[0], true))
-			return;
-		if(start_io_device(pipe->output_fds[0], false))
-			return;
-
-		pipe->input_size[0][0] =
-			vio->rpf_set.bpitch0 * bundle_lines;
-		pipe->input_size[0][1] =
-			vio->rpf_set.bpitch1 * bundle_lines / 2;
-
-		pipe->output_size[0][0] =
-			vio->wpf_set.bpitch0 * wpf_lines;
-		pipe->output_size[0][1] =
-			vio->wpf_set.bpitch1 * wpf_lines / 2;
-
-		vio->output_y_offset = vio->wpf_set.bpitch0 * wpf_lines;
-		vio->output_c_offset = vio->wpf_set.bpitch1 * wpf_lines;
-	}
-
-	if (queue_buffer(pipe->input_fds[0], pipe->input_addr[0],
-			pipe->input_size[0], pipe->input_planes[0], true)) {
+		count = bundle_config(vio, bundle_lines, caps, args,
+				      &rpf_set, &uds_set, &wpf_set);
+		stop_pipeline(pipe);
+		reconfig_pipeline(pipe, caps, args, count);
+		if (start_pipeline(pipe))
+			return -1;
+		vio->bundle_hw_lines = bundle_lines;
+	}
+	wpf_lines = bundle_output_lines(vio, bundle_lines);
+
+	/* The last bundle of a frame is usually shorter.  The pipeline keeps
+	 * the bundle size for it, with the bundle filled out and cropped in
+	 * a buffer of the handle, see tail_buffer. */
+	input_remaining = vio->rpf_set.height - vio->input_lines_done;
+	output_remaining = vio->wpf_set.height - vio->output_lines_done;
+	tail = input_remaining < bundle_lines;
+	out_lines = wpf_lines < output_remaining ? wpf_lines : output_remaining;
+
+	plane_bytes(vio->src_format, vio->rpf_set.bpitch0,
+		    vio->rpf_set.bpitch1, bundle_lines, input_size);
+	plane_bytes(vio->dst_format, vio->wpf_set.bpitch0,
+		    vio->wpf_set.bpitch1, wpf_lines, output_size);
+	if (tail) {
+		in_bytes = TAIL_BUF_ROUND(input_size[0]) +
+			TAIL_BUF_ROUND(input_size[1]);
+		out_bytes = TAIL_BUF_ROUND(output_size[0]) +
+			TAIL_BUF_ROUND(output_size[1]);
+		buf = tail_buffer(vio, in_bytes + out_bytes);
+		if (!buf)
+			return -1;
+		input_addr[0] = buf;
+		input_addr[1] = buf + TAIL_BUF_ROUND(input_size[0]);
+		output_addr[0] = buf + in_bytes;
+		output_addr[1] = buf + in_bytes +
+			TAIL_BUF_ROUND(output_size[0]);
+		fill_tail_input(vio, input_addr, input_size, input_remaining,
+				align);
+	} else {
+		input_addr[0] = pipe->input_addr[0][0];
+		input_addr[1] = pipe->input_addr[0][1];
+		output_addr[0] = pipe->output_addr[0][0];
+		output_addr[1] = pipe->output_addr[0][1];
+	}
+
+	if (sync_pipeline_memory(pipe))
+		return -1;
+
+	if (queue_buffer(pipe->input_fds[0], pipe->next_index,
+			V4L2_MEMORY_USERPTR, input_addr, NULL,
+			input_size, pipe->input_planes[0], true)) {
 		viper_log("%s: queue input buffer fail. %d\n", __FUNCTION__,
 			errno);
-		return;
+		return -1;
 	}
 
-	if (queue_buffer(pipe->output_fds[0], pipe->output_addr[0],
-		pipe->output_size[0], pipe->input_planes[0], false)) {
+	if (queue_buffer(pipe->output_fds[0], pipe->next_index,
+			V4L2_MEMORY_USERPTR, output_addr, NULL,
+			output_size, pipe->output_planes[0], false)) {
 		viper_log("%s: queue output buffer fail. %d\n", __FUNCTION__,
 								errno);
-		return;
+		return -1;
+	}
+	pipe->next_index = (pipe->next_index + 1) % pipe->buffers;
+	pipeline_job_queued(pipe);
+
+	plane_bytes(vio->dst_format, vio->wpf_set.bpitch0,
+		    vio->wpf_set.bpitch1, out_lines, tail_size);
+	if (tail) {
+		vio->tail_src[0] = output_addr[0];
+		vio->tail_src[1] = output_addr[1];
+		vio->tail_dst[0] = pipe->output_addr[0][0];
+		vio->tail_dst[1] = pipe->output_addr[0][1];
+		vio->tail_size[0] = tail_size[0];
+		vio->tail_size[1] =
+			pipe->output_planes[0] > 1 ? tail_size[1] : 0;
 	}
 
-	pipe->output_addr[0][0] += vio->output_y_offset;
-	pipe->output_addr[0][1] += vio->output_c_offset;
+	vio->input_lines_done += tail ? input_remaining : bundle_lines;
+	vio->output_lines_done += out_lines;
+	push_job(vio, vio->output_lines_done,
+		 vio->input_lines_done >= vio->rpf_set.height, true);
+	vio->jobs[(vio->job_head + vio->job_count - 1) %
+		  MAX_QUEUE_DEPTH].tail = tail;
+	pipe->output_addr[0][0] += tail_size[0];
+	pipe->output_addr[0][1] += tail_size[1];
+	return 0;
 }
 
-int shvio_wait(SHVIO *vio)
+void shvio_start_bundle(SHVIO *vio, int bundle_lines)
+{
+	shvio_submit_bundle(vio, bundle_lines);
+}
+
+/* Retire the oldest job, and hand the pipeline back once the frame is
+ * done and nothing else is queued on it.  A pipeline with a buffer pool
+ * stays with the handle until shvio_free_buffers. */
+static int finish_job(SHVIO *vio, struct shvio_job *job)
 {
 	struct viper_pipeline *pipe = vio->pipeline;
-	int i;
-	int ret = 0;
+	int ret;
 
-	if (!pipe)
-		return -1;
+	ret = retire_job(vio, pipe, job);
+	if (!ret && job->tail) {
+		memcpy(vio->tail_dst[0], vio->tail_src[0], vio->tail_size[0]);
+		if (vio->tail_size[1])
+			memcpy(vio->tail_dst[1], vio->tail_src[1],
+			       vio->tail_size[1]);
+	}
+	if (job->last && !pipe->queued && !pipeline_has_buffers(pipe)) {
+		set_pipeline(vio, NULL);
+		release_pipeline(vio->device, pipe);
+	}
+	return ret;
+}
+
+int shvio_wait(SHVIO *vio)
+{
+	struct shvio_job job;
+	int i, ret;
+
+	if (vio->active_stripes) {
+		ret = 0;
+		for (i = 0; i < vio->active_stripes; i++) {
+			if (!vio->stripe_done[i] &&
+					shvio_wait(vio->stripe_vio[i]) < 0)
+				ret = -1;
+			vio->stripe_done[i] = false;
+		}
+		return ret;
+	}
+
+	/* Dropped jobs are not reported: wait for the next one */
+	do {
+		if (!vio->pipeline || !vio->pipeline->queued)
+			return -1;
+		ret = finish_job(vio, &job);
+	} while (!ret && job.dropped);
+
+	if (job.bundle && vio->bundle_cb)
+		vio->bundle_cb(vio->bundle_cb_arg, job.lines, job.last);
+
+	if (ret)
+		return ret;
+	return (job.bundle && job.last) ? 1 : 0;
+}
 
-	vio->bundle_lines_remaining -= vio->bundle_lines;
-	if (vio->bundle_lines_remaining <= 0) {
-		for (i = 0; i < pipe->num_inputs; i++) {
-			dequeue_buffer(pipe->input_fds[i], true);
-			stop_io_device(pipe->input_fds[i], true);
+int shvio_poll(SHVIO *vio)
+{
+	struct viper_pipeline *pipe;
+	struct pollfd fds[MAX_OUTPUT_BUFFERS];
+	struct shvio_job job;
+	int i, ret;
+
+	/* A striped job is done once every stripe is */
+	if (vio->active_stripes) {
+		for (i = 0; i < vio->active_stripes; i++) {
+			if (vio->stripe_done[i])
+				continue;
+			ret = shvio_poll(vio->stripe_vio[i]);
+			if (ret > 0)
+				return 1;
+			if (ret < 0)
+				return -1;
+			vio->stripe_done[i] = true;
 		}
+		for (i = 0; i < vio->active_stripes; i++)
+			vio->stripe_done[i] = false;
+		return 0;
+	}
+
+	for (;;) {
+		pipe = vio->pipeline;
+		if (!pipe || !pipe->queued)
+			return -1;
 
 		for (i = 0; i < pipe->num_outputs; i++) {
-			dequeue_buffer(pipe->output_fds[i], false);
-			stop_io_device(pipe->output_fds[i], false);
+			fds[i].fd = pipe->output_fds[i];
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
 		}
 
-		free_pipeline(vio->device, pipe);
-		vio->pipeline = NULL;
-	} else {
-		for (i = 0; i < pipe->num_inputs; i++)
-			dequeue_buffer(pipe->input_fds[i], true);
+		if (poll(fds, pipe->num_outputs, 0) < 0)
+			return -1;
+
+		for (i = 0; i < pipe->num_outputs; i++) {
+			if (!(fds[i].revents & (POLLIN | POLLERR)))
+				return 1;
+		}
 
-		for (i = 0; i < pipe->num_outputs; i++)
-			dequeue_buffer(pipe->output_fds[i], false);
+		/* A done dropped job says nothing about the next one */
+		if (!vio->job_count || !vio->jobs[vio->job_head].dropped)
+			break;
+		if (finish_job(vio, &job))
+			return -1;
 	}
 
-	return ret;
+	return shvio_wait(vio) < 0 ? -1 : 0;
+}
+
+int shvio_get_fd(SHVIO *vio)
+{
+	int i;
+	if (vio->poll_fd < 0) {
+		vio->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (vio->poll_fd < 0) {
+			viper_log("%s: epoll_create1 failed - %d\n",
+				__FUNCTION__, errno);
+			return -1;
+		}
+		watch_pipeline(vio, vio->pipeline, EPOLL_CTL_ADD);
+		for (i = 0; i < MAX_STRIPES; i++) {
+			if (vio->stripe_vio[i])
+				watch_stripe(vio, vio->stripe_vio[i]);
+		}
+	}
+	return vio->poll_fd;
+}
+
+static int alloc_buffers(SHVIO *vio, bool input, struct shvio_buffer *bufs,
+			 int count)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+	struct viper_buffer *pool;
+	int i, j;
+
+	if (!pipe)
+		return -1;
+
+	count = alloc_pipeline_buffers(pipe, input, 0, count);
+	if (count < 0)
+		return -1;
+
+	pool = input ? pipe->input_pool[0] : pipe->output_pool[0];
+	for (i = 0; i < count; i++) {
+		memset(&bufs[i], 0, sizeof(struct shvio_buffer));
+		bufs[i].index = i;
+		bufs[i].planes = pool[i].planes;
+		for (j = 0; j < pool[i].planes; j++) {
+			bufs[i].addr[j] = pool[i].addr[j];
+			bufs[i].fd[j] = pool[i].dmabuf[j];
+			bufs[i].size[j] = pool[i].length[j];
+		}
+	}
+	return count;
+}
+
+int shvio_alloc_src_buffers(SHVIO *vio, struct shvio_buffer *bufs, int count)
+{
+	return alloc_buffers(vio, true, bufs, count);
+}
+
+int shvio_alloc_dst_buffers(SHVIO *vio, struct shvio_buffer *bufs, int count)
+{
+	return alloc_buffers(vio, false, bufs, count);
+}
+
+void shvio_free_buffers(SHVIO *vio)
+{
+	struct viper_pipeline *pipe = vio->pipeline;
+
+	if (!pipe || jobs_queued(vio, __FUNCTION__))
+		return;
+
+	free_pipeline_buffers(pipe);
 }
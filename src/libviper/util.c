@@ -23,7 +23,11 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
 #include "log.h"
 #include <pthread.h>
 #include <string.h>
@@ -31,6 +35,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <linux/media.h>
 #include <linux/videodev2.h>
 #include <linux/v4l2-subdev.h>
@@ -49,6 +54,7 @@ void dump();
 UIOMux *uiomux;
 struct viper_context viper = {
 	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.reaper_lock = PTHREAD_MUTEX_INITIALIZER,
 	.ref_cnt = 0,
 	.device_list = NULL,
 };
@@ -73,21 +79,29 @@ const struct entity_capability entity_cap_list[] = {
 		.name = "rpf",
 		.caps = VIPER_CAPS_INPUT,
 		.config = configure_rpf,
+		.config_size = sizeof(struct viper_rpf_config),
+		.match_size = sizeof(struct viper_rpf_config),
 	},
 	{
 		.name = "wpf",
 		.caps = VIPER_CAPS_OUTPUT,
 		.config = configure_wpf,
+		.config_size = sizeof(struct viper_wpf_config),
+		.match_size = sizeof(struct viper_wpf_config),
 	},
 	{
 		.name = "uds",
 		.caps = VIPER_CAPS_RESIZE,
 		.config = configure_uds,
+		.config_size = sizeof(struct viper_uds_config),
+		.match_size = sizeof(struct viper_uds_config),
 	},
 	{
 		.name = "bru",
 		.caps = VIPER_CAPS_BLEND,
 		.config = configure_bru,
+		.config_size = sizeof(struct viper_bru_config),
+		.match_size = offsetof(struct viper_bru_config, in_tops),
 	},
 };
 
@@ -118,13 +132,11 @@ void device_add_io_entity(struct viper_device *device,
 		          const char *name,
 		          int id) {
 	struct viper_io_entity *entity;
-	char devfile[255];
 	char *ptr;
 	entity = calloc(1, sizeof(struct viper_io_entity));
-	snprintf(devfile, 255, "/dev/video%d", id);
-	entity->fd = open(devfile, O_RDWR);
-	if (entity->fd < 0)
-		return;
+	/* opened on first use, see entity_open */
+	entity->fd = -1;
+	entity->id = id;
 	entity->name = strdup(name);
 	if ((ptr = strchr(entity->name, '\n')))
 		*ptr = '\0';
@@ -138,18 +150,11 @@ void device_add_entity(struct viper_device *device,
 		       int id) {
 
 	struct viper_entity *entity;
-	struct viper_io_entity *ent;
-	char devfile[255];
 	char *ptr;
 	entity = calloc(1, sizeof(struct viper_entity));
 
-	snprintf(devfile, 255, "/dev/v4l-subdev%d", id);
-
-	entity->fd = open(devfile, O_RDWR);
-
-	if (entity->fd < 0)
-		return;
-
+	entity->fd = -1;
+	entity->id = id;
 	entity->caps = entity_caps;
 	entity->name = strdup(name);
 	if ((ptr = strchr(entity->name, '\n')))
@@ -174,13 +179,36 @@ struct viper_device * find_device(struct viper_context *viper,
 
 }
 
+/* The media controller node of a platform device is its only media%d
+ * child in sysfs */
+static int find_media_device(const char *device_str)
+{
+	char path[255];
+	struct dirent *dent;
+	DIR *dir;
+	int id, media_fd = -1;
+
+	snprintf(path, 255, "/sys/devices/platform/%s", device_str);
+	if (!(dir = opendir(path)))
+		return -1;
+
+	while ((dent = readdir(dir))) {
+		if (sscanf(dent->d_name, "media%d", &id) == 1) {
+			snprintf(path, 255, "/dev/media%d", id);
+			media_fd = open(path, O_RDWR);
+			break;
+		}
+	}
+	closedir(dir);
+	return media_fd;
+}
+
 void register_entity(struct viper_context *viper,
 			 char *device_str,
 			 char *entity_str,
 			 bool io_entity,
 			 int id)
 {
-	int i;
 	struct viper_device *device;
 	const struct entity_capability *entity_caps;
 
@@ -190,26 +218,21 @@ void register_entity(struct viper_context *viper,
 		return;
 
 	if (!(device = find_device(viper, device_str))) {
-		char path[255];
-		int media_fd = -1;
-		struct stat st;
-
-		for (i=255; i>=0; i--) {
-                	sprintf (path, "/sys/devices/platform/%s/media%d",
-								device_str, i);
-	                if (0 == stat (path, &st)) {
-        	                sprintf (path, "/dev/media%d", i);
-	                        media_fd = open (path, O_RDWR);
-				break;
-        	        }
-	        }
-		
+		int media_fd = find_media_device(device_str);
+		pthread_condattr_t cond_attr;
+
 		if (media_fd < 0)
 			return;
 
 		device = calloc(1, sizeof(struct viper_device));
 		strncpy(device->name, device_str, 255);
 		device->media_fd = media_fd;
+		pthread_mutex_init(&device->lock, NULL);
+		pthread_mutex_init(&device->link_lock, NULL);
+		pthread_condattr_init(&cond_attr);
+		pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&device->released, &cond_attr);
+		pthread_condattr_destroy(&cond_attr);
 		device->next = viper->device_list;
 		viper->device_list = device;
 	}
@@ -221,26 +244,183 @@ void register_entity(struct viper_context *viper,
 	
 }
 
-int find_entities(struct viper_context *viper, const char *path_str, bool io_entity) {
-	int i;
+/* Video and subdev nodes as named in sysfs, see discover_topology */
+struct topology_entry {
+	bool	io_entity;
+	int	id;
+	char	device[64];
+	char	entity[64];
+};
+
+#define MAX_TOPOLOGY_ENTRIES 256
+#define TOPOLOGY_CACHE_MAGIC "libviper-topology 1"
+#define V4L_CLASS_PATH "/sys/class/video4linux"
+
+static int compare_entry_id(const void *a, const void *b)
+{
+	return ((const struct topology_entry *)b)->id -
+		((const struct topology_entry *)a)->id;
+}
+
+static int find_entities(struct topology_entry *entries, int count,
+			 const char *prefix, bool io_entity)
+{
 	char subdev_name[256];
-	char path[256];
-
-	for (i = 255; i >= 0; i--) {
-		char *device = NULL;
-		char *token = NULL;	
-		snprintf(path, 255, path_str, i);
-		fgets_with_openclose(path, subdev_name, 255);
-		token = strtok(subdev_name, " ");
-		do {
-			if (!device) {
-				device = token;
-			} else {
-				register_entity(viper, device, token,
-						io_entity, i);
-				break;
-			}
-		} while ((token = strtok(NULL, " ")));
+	char path[sizeof(V4L_CLASS_PATH "//name") + NAME_MAX];
+	char fmt[32];
+	struct dirent *dent;
+	DIR *dir;
+	int id, first = count;
+
+	if (!(dir = opendir(V4L_CLASS_PATH)))
+		return count;
+
+	snprintf(fmt, 32, "%s%%d", prefix);
+	while ((dent = readdir(dir)) && count < MAX_TOPOLOGY_ENTRIES) {
+		char *device, *token;
+		if (sscanf(dent->d_name, fmt, &id) != 1)
+			continue;
+		/* "video%d" also matches the start of other names */
+		snprintf(path, sizeof(path), "%s%d", prefix, id);
+		if (strcmp(path, dent->d_name))
+			continue;
+
+		snprintf(path, sizeof(path), V4L_CLASS_PATH "/%s/name",
+			 dent->d_name);
+		if (fgets_with_openclose(path, subdev_name, 255) <= 0)
+			continue;
+		device = strtok(subdev_name, " ");
+		token = strtok(NULL, " ");
+		if (!device || !token)
+			continue;
+		token[strcspn(token, "\n")] = '\0';
+
+		entries[count].io_entity = io_entity;
+		entries[count].id = id;
+		snprintf(entries[count].device, 64, "%s", device);
+		snprintf(entries[count].entity, 64, "%s", token);
+		count++;
+	}
+	closedir(dir);
+
+	/* Register in the same order as the old /sys probing did */
+	qsort(&entries[first], count - first, sizeof(struct topology_entry),
+	      compare_entry_id);
+	return count;
+}
+
+static int discover_topology(struct topology_entry *entries)
+{
+	int count;
+	/* io entities first, subdevs look their video node up by name */
+	count = find_entities(entries, 0, "video", true);
+	return find_entities(entries, count, "v4l-subdev", false);
+}
+
+/* The optional topology cache (VIPER_TOPOLOGY_CACHE=<file>) saves the
+ * sysfs walk on process start.  It is tagged with the inode and mtime of
+ * /dev, which change whenever device nodes come or go. */
+static int load_topology_cache(const char *fname, const struct stat *dev_st,
+			       struct topology_entry *entries)
+{
+	char magic[32];
+	unsigned long ino;
+	long mtime;
+	int count = 0, io;
+	FILE *fp;
+
+	if (!(fp = fopen(fname, "r")))
+		return -1;
+
+	if (fscanf(fp, "%31[^\n] %lu %ld", magic, &ino, &mtime) != 3 ||
+			strcmp(magic, TOPOLOGY_CACHE_MAGIC) ||
+			ino != (unsigned long)dev_st->st_ino ||
+			mtime != (long)dev_st->st_mtime) {
+		fclose(fp);
+		return -1;
+	}
+
+	while (count < MAX_TOPOLOGY_ENTRIES &&
+			fscanf(fp, "%d %d %63s %63s", &io,
+			       &entries[count].id, entries[count].device,
+			       entries[count].entity) == 4) {
+		entries[count].io_entity = io;
+		count++;
+	}
+	fclose(fp);
+	return count ? count : -1;
+}
+
+static void save_topology_cache(const char *fname, const struct stat *dev_st,
+				struct topology_entry *entries, int count)
+{
+	char tmpname[255];
+	FILE *fp;
+	int i;
+
+	snprintf(tmpname, 255, "%s.%d", fname, getpid());
+	if (!(fp = fopen(tmpname, "w")))
+		return;
+
+	fprintf(fp, "%s\n%lu %ld\n", TOPOLOGY_CACHE_MAGIC,
+		(unsigned long)dev_st->st_ino, (long)dev_st->st_mtime);
+	for (i = 0; i < count; i++)
+		fprintf(fp, "%d %d %s %s\n", entries[i].io_entity,
+			entries[i].id, entries[i].device, entries[i].entity);
+
+	/* Readers only ever see a complete file */
+	if (fclose(fp) || rename(tmpname, fname))
+		unlink(tmpname);
+}
+
+static void register_topology(struct viper_context *viper)
+{
+	struct topology_entry *entries;
+	const char *cache = getenv("VIPER_TOPOLOGY_CACHE");
+	struct stat dev_st;
+	int i, count = -1;
+
+	entries = calloc(MAX_TOPOLOGY_ENTRIES, sizeof(struct topology_entry));
+	if (!entries)
+		return;
+
+	if (cache && stat("/dev", &dev_st))
+		cache = NULL;
+
+	if (cache)
+		count = load_topology_cache(cache, &dev_st, entries);
+
+	if (count < 0) {
+		count = discover_topology(entries);
+		if (cache && count)
+			save_topology_cache(cache, &dev_st, entries, count);
+	}
+
+	for (i = 0; i < count; i++)
+		register_entity(viper, entries[i].device, entries[i].entity,
+				entries[i].io_entity, entries[i].id);
+	free(entries);
+}
+
+/* The link graph is static, so it is read once here. Only the enabled
+ * state changes afterwards, and setup_link keeps that up to date for the
+ * links of the entities we lock. */
+static int enum_entity_links(struct viper_device *dev,
+			     struct viper_entity *entity)
+{
+	struct media_links_enum links;
+
+	if (!entity->link_descs)
+		entity->link_descs = calloc(entity->links,
+					    sizeof(struct media_link_desc));
+
+	memset(&links, 0, sizeof (struct media_links_enum));
+	links.entity = entity->media_id;
+	links.pads = NULL;
+	links.links = entity->link_descs;
+	if (ioctl(dev->media_fd, MEDIA_IOC_ENUM_LINKS, &links)) {
+		viper_log("enum links failed - %d\n", errno);
+		return -1;
 	}
 	return 0;
 }
@@ -263,6 +443,7 @@ int enum_device_entities(struct viper_device *dev) {
 				entity->media_id = last_id;
 				entity->pads = media_ent.pads;
 				entity->links = media_ent.links;
+				enum_entity_links(dev, entity);
 				break;
 			}
 			entity = entity->next;
@@ -283,15 +464,122 @@ int enum_media_entities(struct viper_context *viper)
 	}
 	return 0;
 }
+/* Entity nodes are opened the first time the entity is locked.  With
+ * VIPER_MAX_OPEN_NODES set, idle entities are closed least recently used
+ * first to stay within that many open nodes.  viper.lock protects the
+ * counters; an entity is only closed while nobody holds its lock. */
+
+static void entity_close(struct viper_entity *entity)
+{
+	if (entity->io_entity && entity->io_entity->fd >= 0) {
+		close(entity->io_entity->fd);
+		entity->io_entity->fd = -1;
+		viper.open_nodes--;
+	}
+	if (entity->fd >= 0) {
+		close(entity->fd);
+		entity->fd = -1;
+		viper.open_nodes--;
+	}
+}
+
+/* Called with viper.lock held.  Entities are tried least recently used
+ * first; busy ones, e.g. held by cached pipelines, are passed over. */
+static void evict_idle_entities(struct viper_entity *keep, int needed)
+{
+	struct viper_device *dev;
+	struct viper_entity *entity, *lru;
+	unsigned long skipped = 0;
+
+	while (viper.open_nodes + needed > viper.max_open_nodes) {
+		lru = NULL;
+		for (dev = viper.device_list; dev; dev = dev->next) {
+			for (entity = dev->entity_list; entity;
+					entity = entity->next) {
+				if (entity == keep || entity->fd < 0 ||
+						entity->last_used <= skipped)
+					continue;
+				if (!lru || entity->last_used < lru->last_used)
+					lru = entity;
+			}
+		}
+		if (!lru)
+			return;
+		if (pthread_mutex_trylock(&lru->lock)) {
+			skipped = lru->last_used;
+			continue;
+		}
+		if (lru->busy)
+			skipped = lru->last_used;
+		else
+			entity_close(lru);
+		pthread_mutex_unlock(&lru->lock);
+	}
+}
+
+static int open_node(const char *fmt, int id)
+{
+	char devfile[255];
+	snprintf(devfile, 255, fmt, id);
+	return open(devfile, O_RDWR);
+}
+
+/* Called with entity->lock held */
+static int entity_open(struct viper_entity *entity)
+{
+	struct viper_io_entity *io_entity = entity->io_entity;
+	int needed = 0, ret = 0;
+
+	pthread_mutex_lock(&viper.lock);
+	entity->last_used = ++viper.lock_count;
+	if (entity->fd < 0)
+		needed++;
+	if (io_entity && io_entity->fd < 0)
+		needed++;
+	if (needed && viper.max_open_nodes)
+		evict_idle_entities(entity, needed);
+
+	if (entity->fd < 0) {
+		entity->fd = open_node("/dev/v4l-subdev%d", entity->id);
+		if (entity->fd >= 0)
+			viper.open_nodes++;
+		else
+			ret = -1;
+	}
+	if (io_entity && io_entity->fd < 0) {
+		io_entity->fd = open_node("/dev/video%d", io_entity->id);
+		if (io_entity->fd >= 0)
+			viper.open_nodes++;
+		else
+			ret = -1;
+	}
+	pthread_mutex_unlock(&viper.lock);
+
+	if (ret)
+		viper_log("%s: cannot open %s - %d\n", __FUNCTION__,
+			  entity->name, errno);
+	return ret;
+}
+
+static void stop_cache_reaper(void);
+
 int init_context () {
+	pthread_condattr_t cond_attr;
+
 	pthread_mutex_lock(&viper.lock);
 	if (viper.ref_cnt++) {
 		pthread_mutex_unlock(&viper.lock);
 		return 0;
 	}
 
-	find_entities(&viper, "/sys/class/video4linux/video%d/name", true);
-	find_entities(&viper, "/sys/class/video4linux/v4l-subdev%d/name", false);
+	pthread_condattr_init(&cond_attr);
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&viper.reaper_wake, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+
+	if (getenv("VIPER_MAX_OPEN_NODES"))
+		viper.max_open_nodes = atoi(getenv("VIPER_MAX_OPEN_NODES"));
+	register_topology(&viper);
 	enum_media_entities(&viper);
 
 	pthread_mutex_unlock(&viper.lock);
@@ -308,20 +596,25 @@ int deinit_context() {
 		return 0;
 	}
 
+	stop_cache_reaper();
+	pthread_cond_destroy(&viper.reaper_wake);
 	device = viper.device_list;
 	while (device) {
+		flush_pipeline_cache(device);
 		entity = device->entity_list;
 		while (entity) {
-			if (entity->io_entity)
-				close(entity->io_entity->fd);
+			entity_close(entity);
 			if (entity->name)
 				free(entity->name);
-			close(entity->fd);
+			free(entity->link_descs);
 			tmp = entity;
 			entity = entity->next;
 			free(tmp);
 		}
 		close(device->media_fd);
+		pthread_mutex_destroy(&device->lock);
+		pthread_mutex_destroy(&device->link_lock);
+		pthread_cond_destroy(&device->released);
 		tmp = device;
 		device = device->next;
 		free(tmp);
@@ -331,64 +624,119 @@ int deinit_context() {
 	return 0;
 }
 /*  ----------------------------------------------- */
-
 static void entity_unlock(struct viper_entity *entity) {
+	pthread_mutex_lock(&entity->lock);
 	flock(entity->fd, LOCK_UN);
+	entity->busy = false;
 	pthread_mutex_unlock(&entity->lock);
 }
 
 static int try_entity_lock(struct viper_entity *entity) {
-	if (pthread_mutex_trylock(&entity->lock))
-		return -1;
+	int ret = -1;
 
-	if (flock(entity->fd, LOCK_EX | LOCK_NB)) {
-		pthread_mutex_unlock(&entity->lock);
-		return -1;
+	pthread_mutex_lock(&entity->lock);
+	if (!entity->busy && !entity_open(entity) &&
+			!flock(entity->fd, LOCK_EX | LOCK_NB)) {
+		entity->busy = true;
+		ret = 0;
 	}
-	return 0;
+	pthread_mutex_unlock(&entity->lock);
+	return ret;
 }
 
 
+/* Change the enabled state of a link, skipping the ioctl when the cached
+ * state already matches */
+static int setup_link(struct viper_device *dev, struct media_link_desc *link,
+		      bool enable)
+{
+	struct media_link_desc update_link;
+
+	if (link->flags & MEDIA_LNK_FL_IMMUTABLE)
+		return 0;
+
+	if (!!(link->flags & MEDIA_LNK_FL_ENABLED) == enable)
+		return 0;
+
+	update_link = *link;
+	if (enable)
+		update_link.flags |= MEDIA_LNK_FL_ENABLED;
+	else
+		update_link.flags &= ~MEDIA_LNK_FL_ENABLED;
+
+	if (ioctl(dev->media_fd, MEDIA_IOC_SETUP_LINK, &update_link))
+		return -1;
+
+	link->flags = update_link.flags;
+	return 0;
+}
+
 static int disable_links(struct viper_device *dev,
                   struct viper_entity *entity)
 {
-	int ret, i;
-	struct media_links_enum links;
+	int ret = 0, i;
+
+	if (!entity->link_descs)
+		return -1;
 
-	memset(&links, 0, sizeof (struct media_links_enum));
-	links.entity = entity->media_id;
-	links.pads = NULL;
-	links.links = calloc(entity->links, sizeof(struct media_link_desc));
-	ret = ioctl(dev->media_fd, MEDIA_IOC_ENUM_LINKS, &links);
-	if (ret) {
-		viper_log("enum links failed - %d\n", errno);
-		goto done;
-	}
 	for (i = 0; i < entity->links; i++) {
-		if (links.links[i].flags & MEDIA_LNK_FL_ENABLED) {
-			if (links.links[i].flags & MEDIA_LNK_FL_IMMUTABLE)
-				continue;
-			links.links[i].flags &= ~MEDIA_LNK_FL_ENABLED;
-			if(ioctl(dev->media_fd, MEDIA_IOC_SETUP_LINK,
-					&links.links[i]))
-				viper_log("diable link failed - %d\n", errno);
-			
+		if (setup_link(dev, &entity->link_descs[i], false)) {
+			viper_log("diable link failed - %d\n", errno);
+			ret = -1;
 		}
 	}
-done:
-
-	free(links.links);
 	return ret;
 }
 
-static int enable_links(struct viper_device *dev,
-		struct viper_pipeline *pipe,
-		struct viper_entity *to,
-		int num_suppipes)
+static bool pipeline_has_entity(struct viper_pipeline *pipe,
+				unsigned int media_id)
+{
+	struct viper_entity *entity = pipe->locked_entities;
+	while (entity) {
+		if (entity->media_id == media_id)
+			return true;
+		entity = entity->next_locked;
+	}
+	return false;
+}
+
+static bool link_wanted(struct viper_pipeline *pipe,
+			struct media_link_desc *link)
+{
+	int i;
+	for (i = 0; i < pipe->num_links; i++) {
+		if (pipe->links[i] == link)
+			return true;
+	}
+	return false;
+}
+
+/* The link from 'from' to 'to', or to its sink pad 'pad' if not -1 */
+static struct media_link_desc * find_link(struct viper_entity *from,
+					  struct viper_entity *to, int pad)
+{
+	struct media_link_desc *link;
+	int i;
+
+	for (i = 0; from->link_descs && i < from->links; i++) {
+		link = &from->link_descs[i];
+		if (link->sink.entity != to->media_id)
+			continue;
+		if (pad >= 0 && link->sink.index != pad)
+			continue;
+		return link;
+	}
+	return NULL;
+}
+
+/* Add the links feeding 'to' to the set the pipeline needs.  Nothing is
+ * changed in hardware until reconcile_links. */
+static int route_links(struct viper_pipeline *pipe,
+		struct viper_entity *to)
 {
-	int ret =-2, i;
+	int ret = 0;
 	struct viper_entity *from;
-	struct media_links_enum links;
+	struct media_link_desc *link;
 	int pipe_index;
 
 
@@ -405,43 +753,18 @@ static int enable_links(struct viper_device *dev,
 
 	do {
 		from = pipe->subpipe_final[pipe_index];
-		if (!from) {
-			ret = 0;
+		if (!from)
 			goto no_link;
-		}
 
-		memset(&links, 0, sizeof (struct media_links_enum));
-		links.entity = from->media_id;
-		links.pads = NULL;
-		links.links = calloc(from->links,
-					sizeof(struct media_link_desc));
-
-		ret = ioctl(dev->media_fd, MEDIA_IOC_ENUM_LINKS, &links);
-		if (ret) {
-			viper_log("enum link failed - %d\n", errno);
-			goto links_done;
-		}
-
-		for (i = 0; i < from->links; i++) {
-			if (links.links[i].sink.entity == to->media_id) {
-				if (to->caps->caps & VIPER_CAPS_BLEND &&
-						links.links[i].sink.index !=
-						 pipe_index)
-					continue;
-				struct media_link_desc *update_link;
-				update_link = &links.links[i];
-				update_link->flags |= MEDIA_LNK_FL_ENABLED;
-				ret = ioctl(dev->media_fd,
-					MEDIA_IOC_SETUP_LINK, update_link);
-				if (!ret)
-					break;
-				else if (errno == EBUSY)
-					continue;
-				else
-					return -1;
-			}
+		link = find_link(from, to, (to->caps->caps & VIPER_CAPS_BLEND) ?
+				 pipe_index : -1);
+		ret = -1;
+		if (link && pipe->num_links < MAX_PIPELINE_ENTITIES) {
+			pipe->links[pipe->num_links++] = link;
+			ret = 0;
 		}
-		free(links.links);
+		if (ret)
+			goto links_done;
 	} while ((to->caps->caps & VIPER_CAPS_BLEND) &&
 				(++pipe_index < pipe->active_subpipe));
 
@@ -460,81 +783,588 @@ no_link:
 	return ret;
 }
 
-static struct viper_entity * get_free_entity(struct viper_device *dev,
-				    struct viper_pipeline *pipe,
-		  		    int caps)
+/* Bring the enabled links touching the pipeline's entities to exactly the
+ * routed set, only toggling the links whose cached state differs.  Links
+ * into our entities from entities we don't hold are stale by definition. */
+static int apply_links(struct viper_device *dev, struct viper_pipeline *pipe)
 {
 	struct viper_entity *entity;
+	struct media_link_desc *link;
+	int i, ret = 0;
 
 	entity = dev->entity_list;
 	while (entity) {
-		if (entity->caps->caps & caps) {
-			if (!try_entity_lock(entity)) {
-				entity->next_locked = pipe->locked_entities;
-				disable_links(dev, entity);
-				pipe->locked_entities = entity;
-				return entity;
+		bool ours = pipeline_has_entity(pipe, entity->media_id);
+		for (i = 0; entity->link_descs && i < entity->links; i++) {
+			link = &entity->link_descs[i];
+			if (!(link->flags & MEDIA_LNK_FL_ENABLED) ||
+					link_wanted(pipe, link))
+				continue;
+			if (!ours && !pipeline_has_entity(pipe,
+							  link->sink.entity))
+				continue;
+			if (setup_link(dev, link, false)) {
+				viper_log("diable link failed - %d\n", errno);
+				ret = -1;
 			}
 		}
 		entity = entity->next;
 	}
-	return NULL;
+
+	for (i = 0; i < pipe->num_links; i++) {
+		if (setup_link(dev, pipe->links[i], true)) {
+			viper_log("enable link failed - %d\n", errno);
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int reconcile_links(struct viper_device *dev,
+			   struct viper_pipeline *pipe)
+{
+	struct viper_entity *entity;
+	int ret;
+
+	pthread_mutex_lock(&dev->link_lock);
+	ret = apply_links(dev, pipe);
+	if (ret) {
+		/* The cached link state is stale if another process left
+		 * links behind, e.g. by dying with entities locked. Re-read
+		 * and retry. */
+		entity = dev->entity_list;
+		while (entity) {
+			if (entity->link_descs)
+				enum_entity_links(dev, entity);
+			entity = entity->next;
+		}
+		ret = apply_links(dev, pipe);
+	}
+	pthread_mutex_unlock(&dev->link_lock);
+	return ret;
+}
+
+static bool entity_in(struct viper_entity *entity,
+		      struct viper_entity **set, int count)
+{
+	int i;
+	for (i = 0; i < count; i++) {
+		if (set[i] == entity)
+			return true;
+	}
+	return false;
+}
+
+static int compare_media_id(const void *a, const void *b)
+{
+	const struct viper_entity *ea = *(struct viper_entity * const *)a;
+	const struct viper_entity *eb = *(struct viper_entity * const *)b;
+	return (ea->media_id > eb->media_id) - (ea->media_id < eb->media_id);
+}
+
+/* Subpipe state while searching for a route, as route_links tracks it */
+struct route_state {
+	struct viper_entity *final[MAX_SUBPIPES];
+	int active;
+};
+
+static bool route_step(struct route_state *st, struct viper_entity *to)
+{
+	struct viper_entity *from;
+	int i;
+
+	if (to->caps->caps & VIPER_CAPS_INPUT) {
+		if (st->active == MAX_SUBPIPES)
+			return false;
+		st->final[st->active++] = to;
+		return true;
+	}
+	if (st->active < 1)
+		return false;
+
+	if (to->caps->caps & VIPER_CAPS_BLEND) {
+		for (i = 0; i < st->active; i++) {
+			from = st->final[i];
+			if (from && !find_link(from, to, i))
+				return false;
+		}
+		st->active = 1;
+		st->final[0] = to;
+		return true;
+	}
+
+	from = st->final[st->active - 1];
+	if (from && !find_link(from, to, -1))
+		return false;
+	if (to->caps->caps & VIPER_CAPS_OUTPUT)
+		st->final[--st->active] = NULL;
+	else
+		st->final[st->active - 1] = to;
+	return true;
+}
+
+/* Depth first search of the cached link graph for a chain of entities
+ * matching caps_list[i..] that can be linked to what was chosen so far.
+ * Entities are tried in discovery order, so the result is the same chain
+ * the hardware would have been given before, when it can be routed. */
+static int search_route(struct viper_device *dev, int *caps_list, int length,
+			int i, const struct route_state *st,
+			struct viper_entity **chosen,
+			struct viper_entity **busy, int num_busy)
+{
+	struct viper_entity *entity;
+	struct route_state next;
+
+	if (i == length)
+		return 0;
+
+	for (entity = dev->entity_list; entity; entity = entity->next) {
+		if (!(entity->caps->caps & caps_list[i]) ||
+				entity_in(entity, chosen, i) ||
+				entity_in(entity, busy, num_busy))
+			continue;
+		next = *st;
+		if (!route_step(&next, entity))
+			continue;
+		chosen[i] = entity;
+		if (!search_route(dev, caps_list, length, i + 1, &next,
+				  chosen, busy, num_busy))
+			return 0;
+	}
+	return -1;
+}
+
+/* Lock a whole entity set for caps_list or nothing.  A routable candidate
+ * set is picked, then locked in media_id order; if any entity is taken, the
+ * ones already locked are dropped at once, the busy entity is avoided
+ * and another set is tried.  Nothing is configured or linked until the
+ * set is complete, so competing pipelines never sit on part of the
+ * entities they need. */
+static int reserve_entities(struct viper_device *dev,
+			    struct viper_pipeline *pipe,
+			    int *caps_list, int length,
+			    struct viper_entity **chosen)
+{
+	struct viper_entity *order[MAX_PIPELINE_ENTITIES];
+	struct viper_entity *busy[MAX_DEVICE_ENTITIES];
+	struct route_state route;
+	int i, j, num_busy = 0;
+
+retry:
+	memset(&route, 0, sizeof(route));
+	if (search_route(dev, caps_list, length, 0, &route, chosen,
+			 busy, num_busy)) {
+		viper_log("%s: No free route for %d entities\n",
+			__FUNCTION__, length);
+		return -1;
+	}
+	memcpy(order, chosen, length * sizeof(order[0]));
+
+	qsort(order, length, sizeof(order[0]), compare_media_id);
+	for (i = 0; i < length; i++) {
+		if (!try_entity_lock(order[i]))
+			continue;
+		for (j = 0; j < i; j++)
+			entity_unlock(order[j]);
+		if (num_busy == MAX_DEVICE_ENTITIES)
+			return -1;
+		busy[num_busy++] = order[i];
+		goto retry;
+	}
+
+	/* locked_entities is kept in reverse order of the caps list */
+	for (i = 0; i < length; i++) {
+		invalidate_entity_config(chosen[i]);
+		chosen[i]->next_locked = pipe->locked_entities;
+		pipe->locked_entities = chosen[i];
+	}
+	return 0;
+}
+
+/* Wake local waiters after entities were unlocked or a pipeline returned
+ * to the cache */
+static void signal_released(struct viper_device *dev)
+{
+	pthread_mutex_lock(&dev->lock);
+	pthread_cond_broadcast(&dev->released);
+	pthread_mutex_unlock(&dev->lock);
 }
 
 void free_pipeline(struct viper_device *dev, struct viper_pipeline *pipe)
 {
 	struct viper_entity *entity = pipe->locked_entities;
+	int i;
+	free_pipeline_buffers(pipe);
+	stop_pipeline(pipe);
+	pthread_mutex_lock(&dev->link_lock);
 	while (entity) {
 		disable_links(dev, entity);
 		entity = entity->next_locked;
 	}
+	pthread_mutex_unlock(&dev->link_lock);
 	entity = pipe->locked_entities;
 	while (entity) {
 		entity_unlock(entity);
 		entity = entity->next_locked;
 	}
+	for (i = 0; i < pipe->length; i++)
+		free(pipe->args_list[i]);
 	free(pipe);
+	signal_released(dev);
 	
 }
 
-struct viper_pipeline * create_pipeline(struct viper_device *dev,
+/*  ----------------------------------------------- */
+/* Pipeline cache: pipelines released by the compat layer stay locked,
+ * linked, configured and streaming so that an identical setup only needs to queue
+ * buffers.  Entries are dropped least recently used first, once idle for
+ * longer than PIPELINE_CACHE_TIMEOUT_MS, or when another pipeline cannot
+ * find free entities.  The device lock protects the list. */
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+static void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static bool compare_pipeline(struct viper_pipeline *pipe, int *caps_list,
+			     void **args_list, int length, bool whole)
+{
+	struct viper_entity *entity;
+	int i;
+
+	if (pipe->length != length)
+		return false;
+
+	for (i = 0; i < length; i++) {
+		if (pipe->caps_list[i] != caps_list[i])
+			return false;
+	}
+
+	/* locked_entities is in reverse order of the caps list */
+	entity = pipe->locked_entities;
+	for (i = length - 1; i >= 0; i--) {
+		if (memcmp(pipe->args_list[i], args_list[i],
+			   whole ? entity->caps->config_size :
+			   entity->caps->match_size))
+			return false;
+		entity = entity->next_locked;
+	}
+	return true;
+}
+
+bool pipeline_matches(struct viper_pipeline *pipe, int *caps_list,
+		      void **args_list, int length)
+{
+	return compare_pipeline(pipe, caps_list, args_list, length, true);
+}
+
+/* The pipeline can be brought to the configs by update_pipeline */
+bool pipeline_fits(struct viper_pipeline *pipe, int *caps_list,
+		   void **args_list, int length)
+{
+	return compare_pipeline(pipe, caps_list, args_list, length, false);
+}
+
+/* Reconfigure the entities of a pipeline that fits the configs but
+ * doesn't match them.  The vsp1 driver programs the input locations only
+ * when streaming starts, so the queues are stopped around the update;
+ * that drops buffers still queued, so the jobs must be drained first.
+ * The entity shadows skip what hasn't changed. */
+int update_pipeline(struct viper_pipeline *pipe, void **args_list)
+{
+	struct viper_entity *entity;
+	bool streaming = pipe->streaming;
+	int i, ret = 0;
+
+	entity = pipe->locked_entities;
+	for (i = pipe->length - 1; i >= 0; i--) {
+		if (memcmp(pipe->args_list[i], args_list[i],
+			   entity->caps->config_size))
+			break;
+		entity = entity->next_locked;
+	}
+	if (i < 0)
+		return 0;
+
+	if (pipe->queued) {
+		viper_log("%s: %d jobs still queued\n", __FUNCTION__,
+			pipe->queued);
+		return -1;
+	}
+	stop_pipeline(pipe);
+
+	entity = pipe->locked_entities;
+	for (i = pipe->length - 1; i >= 0; i--) {
+		if (memcmp(pipe->args_list[i], args_list[i],
+			   entity->caps->config_size)) {
+			ret |= entity->caps->config(entity, args_list[i]);
+			memcpy(pipe->args_list[i], args_list[i],
+			       entity->caps->config_size);
+		}
+		entity = entity->next_locked;
+	}
+
+	if (!ret && streaming)
+		ret = start_pipeline(pipe);
+	return ret;
+}
+
+/* Called with dev->lock held. Removes cache entries from 'keep' onwards
+ * and the ones that have been idle for too long. */
+static struct viper_pipeline * expire_pipeline_cache(struct viper_device *dev,
+						     int keep)
+{
+	struct viper_pipeline **prev = &dev->pipeline_cache;
+	struct viper_pipeline *pipe, *expired = NULL;
+	struct timespec now;
+	int count = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while ((pipe = *prev)) {
+		if (count >= keep || elapsed_ms(&pipe->last_used, &now) >
+				PIPELINE_CACHE_TIMEOUT_MS) {
+			*prev = pipe->next_cached;
+			pipe->next_cached = expired;
+			expired = pipe;
+			dev->cached_pipelines--;
+		} else {
+			prev = &pipe->next_cached;
+			count++;
+		}
+	}
+	return expired;
+}
+
+static void free_pipeline_list(struct viper_device *dev,
+			       struct viper_pipeline *pipe)
+{
+	struct viper_pipeline *next;
+	while (pipe) {
+		next = pipe->next_cached;
+		free_pipeline(dev, pipe);
+		pipe = next;
+	}
+}
+
+static struct viper_pipeline * lookup_cached_pipeline(struct viper_device *dev,
+		int *caps_list, void **args_list, int length)
+{
+	struct viper_pipeline **prev, **fit = NULL, *pipe, *expired;
+
+	/* An exact match is taken over one that only fits */
+	pthread_mutex_lock(&dev->lock);
+	expired = expire_pipeline_cache(dev, PIPELINE_CACHE_SIZE);
+	prev = &dev->pipeline_cache;
+	while ((pipe = *prev)) {
+		if (pipeline_matches(pipe, caps_list, args_list, length))
+			break;
+		if (!fit && pipeline_fits(pipe, caps_list, args_list, length))
+			fit = prev;
+		prev = &pipe->next_cached;
+	}
+	if (!pipe && fit)
+		pipe = *(prev = fit);
+	if (pipe) {
+		*prev = pipe->next_cached;
+		pipe->next_cached = NULL;
+		dev->cached_pipelines--;
+	}
+	pthread_mutex_unlock(&dev->lock);
+
+	free_pipeline_list(dev, expired);
+
+	if (pipe && update_pipeline(pipe, args_list)) {
+		viper_log("%s: cannot update cached pipeline\n",
+			__FUNCTION__);
+		free_pipeline(dev, pipe);
+		pipe = NULL;
+	}
+	return pipe;
+}
+
+/* Idle cached pipelines keep their entities locked, which other processes
+ * can't see.  So that a process going idle with pipelines cached doesn't
+ * hold them for good, a thread expires them once the timeout passes. */
+static void *cache_reaper(void *arg)
+{
+	struct viper_device *dev;
+	struct viper_pipeline *pipe, *expired;
+	struct timespec now, wake;
+	long next, left;
+
+	pthread_mutex_lock(&viper.reaper_lock);
+	while (!viper.reaper_stop) {
+		pthread_mutex_unlock(&viper.reaper_lock);
+
+		next = -1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (dev = viper.device_list; dev; dev = dev->next) {
+			pthread_mutex_lock(&dev->lock);
+			expired = expire_pipeline_cache(dev,
+							PIPELINE_CACHE_SIZE);
+			for (pipe = dev->pipeline_cache; pipe;
+					pipe = pipe->next_cached) {
+				left = PIPELINE_CACHE_TIMEOUT_MS + 1 -
+					elapsed_ms(&pipe->last_used, &now);
+				if (next < 0 || left < next)
+					next = left;
+			}
+			pthread_mutex_unlock(&dev->lock);
+			free_pipeline_list(dev, expired);
+		}
+
+		pthread_mutex_lock(&viper.reaper_lock);
+		if (viper.reaper_stop)
+			break;
+		if (next < 0) {
+			pthread_cond_wait(&viper.reaper_wake,
+					  &viper.reaper_lock);
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &wake);
+			timespec_add_ms(&wake, next);
+			pthread_cond_timedwait(&viper.reaper_wake,
+					       &viper.reaper_lock, &wake);
+		}
+	}
+	pthread_mutex_unlock(&viper.reaper_lock);
+	return arg;
+}
+
+/* Called when a device cache gets its first entry; the reaper may be
+ * sleeping with nothing to expire */
+static void wake_cache_reaper(void)
+{
+	pthread_mutex_lock(&viper.reaper_lock);
+	if (!viper.reaper_running) {
+		if (pthread_create(&viper.reaper, NULL, cache_reaper, NULL))
+			viper_log("%s: cannot start reaper - %d\n",
+				  __FUNCTION__, errno);
+		else
+			viper.reaper_running = true;
+	}
+	pthread_cond_signal(&viper.reaper_wake);
+	pthread_mutex_unlock(&viper.reaper_lock);
+}
+
+static void stop_cache_reaper(void)
+{
+	pthread_mutex_lock(&viper.reaper_lock);
+	if (!viper.reaper_running) {
+		pthread_mutex_unlock(&viper.reaper_lock);
+		return;
+	}
+	viper.reaper_stop = true;
+	pthread_cond_signal(&viper.reaper_wake);
+	pthread_mutex_unlock(&viper.reaper_lock);
+
+	pthread_join(viper.reaper, NULL);
+	viper.reaper_running = false;
+	viper.reaper_stop = false;
+}
+
+void release_pipeline(struct viper_device *dev, struct viper_pipeline *pipe)
+{
+	struct viper_pipeline *expired;
+	bool first;
+
+	/* Pool buffers belong to the handle that allocated them */
+	free_pipeline_buffers(pipe);
+
+	pthread_mutex_lock(&dev->lock);
+	clock_gettime(CLOCK_MONOTONIC, &pipe->last_used);
+	pipe->next_cached = dev->pipeline_cache;
+	dev->pipeline_cache = pipe;
+	first = !dev->cached_pipelines++;
+	expired = expire_pipeline_cache(dev, PIPELINE_CACHE_SIZE);
+	pthread_cond_broadcast(&dev->released);
+	pthread_mutex_unlock(&dev->lock);
+
+	free_pipeline_list(dev, expired);
+	if (first)
+		wake_cache_reaper();
+}
+
+int flush_pipeline_cache(struct viper_device *dev)
+{
+	struct viper_pipeline *expired;
+	int count;
+
+	pthread_mutex_lock(&dev->lock);
+	count = dev->cached_pipelines;
+	expired = expire_pipeline_cache(dev, 0);
+	pthread_mutex_unlock(&dev->lock);
+
+	free_pipeline_list(dev, expired);
+	return count;
+}
+
+static struct viper_pipeline * build_pipeline(struct viper_device *dev,
 		int *caps_list, void **args_list, int length) {
-#if 0
-		struct viper_pipeline *pipeline, int length,
-		int *in_fd, int *out_fd) {
-#endif
 	int i;
+	struct viper_entity *entities[MAX_PIPELINE_ENTITIES];
 	struct viper_entity *entity;
 	struct viper_pipeline *pipe;
 	
 	/* need to seach for appropriate device */
 	pipe = calloc(1, sizeof(struct viper_pipeline));
+	pipe->dev = dev;
+
+	if (reserve_entities(dev, pipe, caps_list, length, entities)) {
+		free(pipe);
+		return NULL;
+	}
 
 	for (i = 0; i < length; i++) {
-		entity = get_free_entity(dev, pipe, caps_list[i]);
-		if (!entity) {
-			viper_log("%s: No free enities for cap type %d",
-				__FUNCTION__, caps_list[i]);
-			goto error_out;
-		}
+		entity = entities[i];
 		if (entity->caps->config(entity, args_list[i])) {
 			viper_log("%s: entity config error - %s",
 				__FUNCTION__, entity->name);
 			goto error_out;
 		}
-		if (caps_list[i] & VIPER_CAPS_INPUT)
+		pipe->caps_list[i] = caps_list[i];
+		pipe->args_list[i] = malloc(entity->caps->config_size);
+		memcpy(pipe->args_list[i], args_list[i],
+			entity->caps->config_size);
+		pipe->length++;
+		if (caps_list[i] & VIPER_CAPS_INPUT) {
+			pipe->input_memory[pipe->num_inputs] =
+				V4L2_MEMORY_USERPTR;
+			pipe->input_queue_memory[pipe->num_inputs] =
+				V4L2_MEMORY_USERPTR;
 			pipe->input_fds[pipe->num_inputs++] = 
 				entity->io_entity->fd;
-		if (caps_list[i] & VIPER_CAPS_OUTPUT)
+		}
+		if (caps_list[i] & VIPER_CAPS_OUTPUT) {
+			pipe->output_memory[pipe->num_outputs] =
+				V4L2_MEMORY_USERPTR;
+			pipe->output_queue_memory[pipe->num_outputs] =
+				V4L2_MEMORY_USERPTR;
 			pipe->output_fds[pipe->num_outputs++] = 
 				entity->io_entity->fd;
-		if (enable_links(dev, pipe, entity, 1)) {
-			viper_log("%s: Entity link failed. caps=%d",
+		}
+		if (route_links(pipe, entity)) {
+			viper_log("%s: No route to entity. caps=%d",
 				__FUNCTION__, caps_list[i]);
 			goto error_out;
 		}
 	}
 
+	if (reconcile_links(dev, pipe)) {
+		viper_log("%s: Entity link failed", __FUNCTION__);
+		goto error_out;
+	}
+
 	return pipe;
 
 error_out:
@@ -545,7 +1375,116 @@ error_out:
 	return NULL;
 }
 
-int stop_io_device(int fd, bool input) {
+static struct viper_pipeline * try_create_pipeline(struct viper_device *dev,
+		int *caps_list, void **args_list, int length) {
+	struct viper_pipeline *pipe;
+
+	pipe = lookup_cached_pipeline(dev, caps_list, args_list, length);
+	if (pipe)
+		return pipe;
+
+	pipe = build_pipeline(dev, caps_list, args_list, length);
+	/* Idle cached pipelines may be holding the entities we need */
+	if (!pipe && flush_pipeline_cache(dev))
+		pipe = build_pipeline(dev, caps_list, args_list, length);
+	return pipe;
+}
+
+/* Threads of this process waiting for busy entities are served in arrival
+ * order: they queue on dev->waiters and are woken when a pipeline is
+ * released; only the head one retries.  Between processes the head waiter
+ * holds a flock on the media device, taken in no particular order, so one
+ * process at a time is waiting and a waiting pipeline can't keep losing
+ * part of its entities to another waiting pipeline.  Releases in other processes are not signalled, so
+ * the head also retries every ACQUIRE_POLL_MS. */
+struct viper_pipeline * create_pipeline(struct viper_device *dev,
+		int *caps_list, void **args_list, int length, int timeout_ms) {
+	struct viper_pipeline *pipe;
+	struct viper_waiter self, **waiter;
+	struct timespec now, deadline, wake;
+	bool gated = false;
+
+	if (length > MAX_PIPELINE_ENTITIES)
+		return NULL;
+
+	pipe = try_create_pipeline(dev, caps_list, args_list, length);
+	if (pipe || !timeout_ms)
+		return pipe;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	if (timeout_ms > 0)
+		timespec_add_ms(&deadline, timeout_ms);
+
+	pthread_mutex_lock(&dev->lock);
+	dev->waits++;
+	self.next = NULL;
+	for (waiter = &dev->waiters; *waiter; waiter = &(*waiter)->next)
+		;
+	*waiter = &self;
+
+	for (;;) {
+		if (dev->waiters == &self) {
+			pthread_mutex_unlock(&dev->lock);
+			if (!gated)
+				gated = !flock(dev->media_fd, LOCK_EX | LOCK_NB);
+			if (gated)
+				pipe = try_create_pipeline(dev, caps_list,
+							   args_list, length);
+			pthread_mutex_lock(&dev->lock);
+			if (pipe)
+				break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timeout_ms > 0 && elapsed_ms(&deadline, &now) >= 0) {
+			dev->timeouts++;
+			break;
+		}
+		wake = now;
+		timespec_add_ms(&wake, ACQUIRE_POLL_MS);
+		if (timeout_ms > 0 && elapsed_ms(&deadline, &wake) > 0)
+			wake = deadline;
+		pthread_cond_timedwait(&dev->released, &dev->lock, &wake);
+	}
+
+	for (waiter = &dev->waiters; *waiter != &self;
+			waiter = &(*waiter)->next)
+		;
+	*waiter = self.next;
+	if (gated)
+		flock(dev->media_fd, LOCK_UN);
+	pthread_cond_broadcast(&dev->released);
+	pthread_mutex_unlock(&dev->lock);
+
+	if (!pipe)
+		viper_log("%s: timed out waiting for free entities\n",
+			__FUNCTION__);
+	return pipe;
+}
+
+/* Apply new configs to the entities of a locked pipeline and keep the
+ * cache key in step with what the hardware is programmed with. */
+int reconfig_pipeline(struct viper_pipeline *pipe, int *caps, void **args,
+		      int count)
+{
+	struct viper_entity *entity;
+	int i, j, ret = 0;
+	for (i = 0; i < count; i++) {
+		entity = pipe->locked_entities;
+		for (j = pipe->length - 1; j >= 0; j--) {
+			if (pipe->caps_list[j] == caps[i]) {
+				ret |= entity->caps->config(entity, args[i]);
+				memcpy(pipe->args_list[j], args[i],
+					entity->caps->config_size);
+				break;
+			}
+			entity = entity->next_locked;
+		}
+	}
+	return ret;
+}
+
+int stop_io_device(int fd, bool input, enum v4l2_memory memory) {
 	struct v4l2_requestbuffers reqbuf;
 	enum v4l2_buf_type buftype;
 	if (input)
@@ -555,9 +1494,14 @@ int stop_io_device(int fd, bool input) {
 
 	ioctl(fd, VIDIOC_STREAMOFF, &buftype);
 
+	/* MMAP buffers belong to the buffer pool and outlive streaming */
+	if (memory == V4L2_MEMORY_MMAP)
+		return 0;
+
+	memset(&reqbuf, 0, sizeof(reqbuf));
 	reqbuf.count = 0;
 	reqbuf.type = buftype;
-	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.memory = memory;
 	if(ioctl(fd, VIDIOC_REQBUFS, &reqbuf)) {
 		printf("reqbufs 0 failed for %s on %d - %d\n",
 			input ? "input" : "output", fd, errno);
@@ -566,7 +1510,8 @@ int stop_io_device(int fd, bool input) {
 	return 0;
 }
 
-int start_io_device(int fd, bool input) {
+/* Returns the number of buffer slots allocated or -1 on failure */
+int start_io_device(int fd, bool input, enum v4l2_memory memory, int count) {
 	struct v4l2_requestbuffers reqbuf;
 	enum v4l2_buf_type buftype;
 	memset(&reqbuf, 0, sizeof(reqbuf));
@@ -576,12 +1521,13 @@ int start_io_device(int fd, bool input) {
 	else
 		buftype = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 
-	reqbuf.count = 1;
+	reqbuf.count = count;
 	reqbuf.type = buftype;
-	reqbuf.memory = V4L2_MEMORY_USERPTR;
+	reqbuf.memory = memory;
 
 
-	if(ioctl(fd, VIDIOC_REQBUFS, &reqbuf)) {
+	if(memory != V4L2_MEMORY_MMAP &&
+			ioctl(fd, VIDIOC_REQBUFS, &reqbuf)) {
 		viper_log("reqbufs failed for %s stream on %d - %d\n",
 			input ? "input" : "output", fd, errno);
 		return -1;
@@ -590,15 +1536,345 @@ int start_io_device(int fd, bool input) {
 	if(ioctl(fd, VIDIOC_STREAMON, &buftype)) {
 		viper_log("stream on failed for %s stream on %d - %d\n",
 			input ? "input" : "output", fd, errno);
-		stop_io_device(fd, input);
+		stop_io_device(fd, input, memory);
+		return -1;
+	}
+	return reqbuf.count;
+}
+
+/* Request buffer slots and start streaming on every queue of the pipeline.
+ * The queues then stay streaming until stop_pipeline, so that a cached
+ * pipeline only has to queue and dequeue buffers per frame. */
+int start_pipeline(struct viper_pipeline *pipe)
+{
+	int i, count, buffers = MAX_QUEUE_DEPTH;
+
+	if (pipe->streaming)
+		return 0;
+
+	for (i = 0; i < pipe->num_inputs; i++) {
+		count = start_io_device(pipe->input_fds[i], true,
+				pipe->input_queue_memory[i],
+				pipe->input_pool[i] ? pipe->input_pool_size[i] :
+				MAX_QUEUE_DEPTH);
+		if (count < 0)
+			goto err_out;
+		if (count < buffers)
+			buffers = count;
+	}
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		count = start_io_device(pipe->output_fds[i], false,
+				pipe->output_queue_memory[i],
+				pipe->output_pool[i] ? pipe->output_pool_size[i] :
+				MAX_QUEUE_DEPTH);
+		if (count < 0) {
+			while (i--)
+				stop_io_device(pipe->output_fds[i], false,
+					pipe->output_queue_memory[i]);
+			i = pipe->num_inputs;
+			goto err_out;
+		}
+		if (count < buffers)
+			buffers = count;
+	}
+
+	pipe->buffers = buffers;
+	pipe->next_index = 0;
+	pipe->queued = 0;
+	pipe->streaming = true;
+	return 0;
+
+err_out:
+	while (i--)
+		stop_io_device(pipe->input_fds[i], true,
+			pipe->input_queue_memory[i]);
+	return -1;
+}
+
+void stop_pipeline(struct viper_pipeline *pipe)
+{
+	int i;
+
+	if (!pipe->streaming)
+		return;
+
+	for (i = 0; i < pipe->num_inputs; i++)
+		stop_io_device(pipe->input_fds[i], true,
+			pipe->input_queue_memory[i]);
+
+	for (i = 0; i < pipe->num_outputs; i++)
+		stop_io_device(pipe->output_fds[i], false,
+			pipe->output_queue_memory[i]);
+
+	__sync_fetch_and_sub(&pipe->dev->inflight, pipe->queued);
+	pipe->queued = 0;
+	pipe->streaming = false;
+}
+
+/* Jobs are counted per device too, as a load measure for handles that
+ * may use any device */
+void pipeline_job_queued(struct viper_pipeline *pipe)
+{
+	pipe->queued++;
+	__sync_fetch_and_add(&pipe->dev->inflight, 1);
+}
+
+void pipeline_job_done(struct viper_pipeline *pipe)
+{
+	pipe->queued--;
+	__sync_fetch_and_sub(&pipe->dev->inflight, 1);
+}
+
+/* A queue only accepts buffers of the memory type it was started with.
+ * Restart the queues when the buffers set for the next job are of another
+ * type, which is only possible while nothing is queued. */
+int sync_pipeline_memory(struct viper_pipeline *pipe)
+{
+	bool changed = false;
+	int i;
+
+	for (i = 0; i < pipe->num_inputs; i++)
+		changed |= (pipe->input_memory[i] !=
+			    pipe->input_queue_memory[i]);
+
+	for (i = 0; i < pipe->num_outputs; i++)
+		changed |= (pipe->output_memory[i] !=
+			    pipe->output_queue_memory[i]);
+
+	if (!changed)
+		return 0;
+
+	for (i = 0; i < pipe->num_inputs; i++) {
+		if (pipe->input_pool[i] && pipe->input_memory[i] !=
+				V4L2_MEMORY_MMAP)
+			goto pool_busy;
+	}
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		if (pipe->output_pool[i] && pipe->output_memory[i] !=
+				V4L2_MEMORY_MMAP)
+			goto pool_busy;
+	}
+
+	if (pipe->queued) {
+		viper_log("%s: cannot change memory type with %d jobs queued\n",
+			__FUNCTION__, pipe->queued);
+		return -1;
+	}
+
+	stop_pipeline(pipe);
+	memcpy(pipe->input_queue_memory, pipe->input_memory,
+		sizeof(pipe->input_memory));
+	memcpy(pipe->output_queue_memory, pipe->output_memory,
+		sizeof(pipe->output_memory));
+	return start_pipeline(pipe);
+
+pool_busy:
+	viper_log("%s: queue has a buffer pool, free it first\n",
+		__FUNCTION__);
+	return -1;
+}
+
+static void unmap_buffers(struct viper_buffer *pool, int count)
+{
+	int i, j;
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < pool[i].planes; j++) {
+			if (pool[i].addr[j] && pool[i].addr[j] != MAP_FAILED)
+				munmap(pool[i].addr[j], pool[i].length[j]);
+			if (pool[i].dmabuf[j] >= 0)
+				close(pool[i].dmabuf[j]);
+		}
+	}
+	free(pool);
+}
+
+static int free_queue_buffers(int fd, bool input, struct viper_buffer *pool,
+			      int count)
+{
+	struct v4l2_requestbuffers reqbuf;
+
+	unmap_buffers(pool, count);
+
+	memset(&reqbuf, 0, sizeof(reqbuf));
+	reqbuf.count = 0;
+	reqbuf.type = input ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE :
+			      V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	reqbuf.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &reqbuf)) {
+		viper_log("%s: reqbufs 0 failed on %d - %d\n", __FUNCTION__,
+			fd, errno);
 		return -1;
 	}
 	return 0;
 }
 
-int dequeue_buffer(int fd, bool input)
+/* Have the driver allocate 'count' buffers for one queue from the format
+ * set by configure_rpf/configure_wpf, then map and export each plane so the
+ * buffers can be filled by the CPU or shared with other devices.  Queueing
+ * one later is a plain QBUF of its index. Returns the number of buffers
+ * allocated or -1 on failure. */
+int alloc_pipeline_buffers(struct viper_pipeline *pipe, bool input, int idx,
+			   int count)
+{
+	struct v4l2_requestbuffers reqbuf;
+	struct v4l2_buffer buf;
+	struct v4l2_plane planes[MAX_PLANES];
+	struct v4l2_exportbuffer expbuf;
+	struct viper_buffer *pool;
+	enum v4l2_buf_type buftype;
+	int fd, i, j;
+
+	if (pipe->queued)
+		return -1;
+
+	if (input) {
+		if (idx >= pipe->num_inputs || pipe->input_pool[idx])
+			return -1;
+		fd = pipe->input_fds[idx];
+		buftype = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	} else {
+		if (idx >= pipe->num_outputs || pipe->output_pool[idx])
+			return -1;
+		fd = pipe->output_fds[idx];
+		buftype = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	}
+
+	stop_pipeline(pipe);
+
+	memset(&reqbuf, 0, sizeof(reqbuf));
+	reqbuf.count = count;
+	reqbuf.type = buftype;
+	reqbuf.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(fd, VIDIOC_REQBUFS, &reqbuf) || !reqbuf.count) {
+		viper_log("%s: reqbufs failed on %d - %d\n", __FUNCTION__,
+			fd, errno);
+		return -1;
+	}
+	count = reqbuf.count;
+
+	pool = calloc(count, sizeof(struct viper_buffer));
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < MAX_PLANES; j++)
+			pool[i].dmabuf[j] = -1;
+
+		memset(&buf, 0, sizeof(buf));
+		buf.type = buftype;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		buf.m.planes = planes;
+		buf.length = MAX_PLANES;
+		if (ioctl(fd, VIDIOC_QUERYBUF, &buf)) {
+			viper_log("%s: querybuf failed - %d\n", __FUNCTION__,
+				errno);
+			goto err_out;
+		}
+
+		pool[i].planes = buf.length;
+		for (j = 0; j < pool[i].planes; j++) {
+			pool[i].length[j] = planes[j].length;
+			pool[i].addr[j] = mmap(NULL, planes[j].length,
+				PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				planes[j].m.mem_offset);
+			if (pool[i].addr[j] == MAP_FAILED) {
+				viper_log("%s: mmap failed - %d\n",
+					__FUNCTION__, errno);
+				goto err_out;
+			}
+
+			memset(&expbuf, 0, sizeof(expbuf));
+			expbuf.type = buftype;
+			expbuf.index = i;
+			expbuf.plane = j;
+			expbuf.flags = O_CLOEXEC | O_RDWR;
+			if (ioctl(fd, VIDIOC_EXPBUF, &expbuf)) {
+				viper_log("%s: expbuf failed - %d\n",
+					__FUNCTION__, errno);
+				goto err_out;
+			}
+			pool[i].dmabuf[j] = expbuf.fd;
+		}
+	}
+
+	if (input) {
+		pipe->input_pool[idx] = pool;
+		pipe->input_pool_size[idx] = count;
+		pipe->input_memory[idx] = V4L2_MEMORY_MMAP;
+		pipe->input_queue_memory[idx] = V4L2_MEMORY_MMAP;
+		pipe->input_index[idx] = 0;
+	} else {
+		pipe->output_pool[idx] = pool;
+		pipe->output_pool_size[idx] = count;
+		pipe->output_memory[idx] = V4L2_MEMORY_MMAP;
+		pipe->output_queue_memory[idx] = V4L2_MEMORY_MMAP;
+		pipe->output_index[idx] = 0;
+	}
+
+	if (start_pipeline(pipe))
+		return -1;
+	return count;
+
+err_out:
+	free_queue_buffers(fd, input, pool, i + 1);
+	return -1;
+}
+
+/* Release every buffer pool of the pipeline. The queues fall back to
+ * USERPTR and are restarted by the next start_pipeline. */
+void free_pipeline_buffers(struct viper_pipeline *pipe)
+{
+	int i;
+
+	if (!pipeline_has_buffers(pipe))
+		return;
+
+	stop_pipeline(pipe);
+
+	for (i = 0; i < pipe->num_inputs; i++) {
+		if (!pipe->input_pool[i])
+			continue;
+		free_queue_buffers(pipe->input_fds[i], true,
+			pipe->input_pool[i], pipe->input_pool_size[i]);
+		pipe->input_pool[i] = NULL;
+		pipe->input_pool_size[i] = 0;
+		pipe->input_memory[i] = V4L2_MEMORY_USERPTR;
+		pipe->input_queue_memory[i] = V4L2_MEMORY_USERPTR;
+	}
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		if (!pipe->output_pool[i])
+			continue;
+		free_queue_buffers(pipe->output_fds[i], false,
+			pipe->output_pool[i], pipe->output_pool_size[i]);
+		pipe->output_pool[i] = NULL;
+		pipe->output_pool_size[i] = 0;
+		pipe->output_memory[i] = V4L2_MEMORY_USERPTR;
+		pipe->output_queue_memory[i] = V4L2_MEMORY_USERPTR;
+	}
+}
+
+bool pipeline_has_buffers(struct viper_pipeline *pipe)
+{
+	int i;
+
+	for (i = 0; i < pipe->num_inputs; i++) {
+		if (pipe->input_pool[i])
+			return true;
+	}
+
+	for (i = 0; i < pipe->num_outputs; i++) {
+		if (pipe->output_pool[i])
+			return true;
+	}
+	return false;
+}
+
+/* Returns the index of the dequeued buffer or -1 on failure */
+int dequeue_buffer(int fd, bool input, enum v4l2_memory memory)
 {
 	struct v4l2_buffer buf;
+	struct v4l2_plane planes[MAX_PLANES];
 	enum v4l2_buf_type buftype;
 
 	if (input)
@@ -608,43 +1884,57 @@ int dequeue_buffer(int fd, bool input)
 
 	memset(&buf, 0, sizeof(buf));
 	buf.type = buftype;
-	buf.memory = V4L2_MEMORY_USERPTR;
-	return ioctl(fd, VIDIOC_DQBUF, &buf);
+	buf.memory = memory;
+	buf.m.planes = planes;
+	buf.length = MAX_PLANES;
+	if (ioctl(fd, VIDIOC_DQBUF, &buf))
+		return -1;
+	return buf.index;
 }
 
-int queue_buffer(int fd, void **buffer, int *size, int count, bool input)
+/* buffer holds the plane addresses for V4L2_MEMORY_USERPTR and dmabuf the
+ * plane file descriptors for V4L2_MEMORY_DMABUF */
+int queue_buffer(int fd, int index, enum v4l2_memory memory, void **buffer,
+		 int *dmabuf, int *size, int count, bool input)
 {
 	struct v4l2_buffer buf;
-	struct v4l2_plane *planes;
+	struct v4l2_plane planes[MAX_PLANES];
 	enum v4l2_buf_type buftype;
-	int ret, i;
+	int i;
+
+	if (count > MAX_PLANES) {
+		viper_log("%s: %d planes, at most %d supported\n",
+			__FUNCTION__, count, MAX_PLANES);
+		errno = EINVAL;
+		return -1;
+	}
 
 	if (input)
 		buftype = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
 	else
 		buftype = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
 
-	planes = calloc(count, sizeof(struct v4l2_plane));
-
+	memset(planes, 0, sizeof(planes));
 	memset(&buf, 0, sizeof(buf));
 	buf.type = buftype;
-	buf.index = 0;
+	buf.index = index;
 	buf.field = V4L2_FIELD_NONE;
-	buf.memory = V4L2_MEMORY_USERPTR;
+	buf.memory = memory;
 	buf.m.planes = planes;
 	buf.length = count;
 
 
 	for (i = 0; i < count; i++) {
 		planes[i].length = size[i];
-		planes[i].m.userptr = (unsigned long) buffer[i];
+		if (memory == V4L2_MEMORY_DMABUF)
+			planes[i].m.fd = dmabuf[i];
+		else
+			planes[i].m.userptr = (unsigned long) buffer[i];
 		if (input)
 			planes[i].bytesused = size[i];
 	}
 
-	ret =  ioctl(fd, VIDIOC_QBUF, &buf);
-	free(planes);
-	return ret;
+	return ioctl(fd, VIDIOC_QBUF, &buf);
 }
 #if 0
 int resize_pipeline(struct viper_context *viper) {
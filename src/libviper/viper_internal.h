@@ -27,6 +27,7 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <time.h>
 #include <linux/media.h>
 #include <linux/videodev2.h>
 #include <linux/v4l2-subdev.h>
@@ -40,6 +41,16 @@
 
 #define MAX_SUBPIPES 4
 
+/* BRU_MAX_INPUTS x (rpf + uds) + bru + wpf */
+#define MAX_PIPELINE_ENTITIES 10
+
+/* Upper bound on the entities of one device, see reserve_entities */
+#define MAX_DEVICE_ENTITIES 32
+
+/* Idle pipelines kept locked and configured per device */
+#define PIPELINE_CACHE_SIZE 4
+#define PIPELINE_CACHE_TIMEOUT_MS 500
+
 struct viper_entity;
 
 struct entity_capability {
@@ -47,33 +58,85 @@ struct entity_capability {
 	bool		io_entity;
 	unsigned int 	caps;
 	int (*config) (struct viper_entity *entity, void *args);
+	size_t		config_size;
+	/* leading bytes of the config a pipeline must have been set up
+	 * with to be reused; the rest is reconfigured in place */
+	size_t		match_size;
 };
 
 struct viper_io_entity {
 	char *name;
 	int fd;	
+	int id;		/* /dev/video%d */
 	struct viper_io_entity *next;
 };
 
 
+/* bru: BRU_MAX_INPUTS sink pads + 1 source pad */
+#define MAX_ENTITY_PADS 5
+
+/* Formats and selections last applied through entity_config.c.  Only
+ * valid while the entity is locked, as another process may change them. */
+struct viper_entity_shadow {
+	unsigned int	fmt_valid;	/* bitmask of pads */
+	unsigned int	sel_valid;
+	bool		video_fmt_valid;
+	/* the one control an entity needs: rpf alpha or bru background */
+	bool		ctrl_valid;
+	int		ctrl_value;
+	struct v4l2_mbus_framefmt fmt[MAX_ENTITY_PADS];
+	struct v4l2_rect sel[MAX_ENTITY_PADS];
+	struct v4l2_format video_fmt;
+};
+
 struct viper_entity {
 	const struct entity_capability *caps;
 	char *name;
 	int pads;
 	int links;
+	/* outbound links, enumerated once; flags track what we set */
+	struct media_link_desc *link_descs;
+	struct viper_entity_shadow shadow;
+	/* busy is set while a pipeline owns the entity, which may be freed
+	 * by another thread than the one that built it; lock is only held
+	 * to change busy or open and close the nodes */
 	pthread_mutex_t	lock;
+	bool busy;
 	int fd;
+	int id;		/* /dev/v4l-subdev%d */
+	unsigned long last_used;
 	unsigned int media_id;
 	struct viper_io_entity *io_entity;
 	struct viper_entity *next;
 	struct viper_entity *next_locked;
 };
 
+struct viper_pipeline;
+
+/* Retry interval of a pipeline waiting for entities, see create_pipeline */
+#define ACQUIRE_POLL_MS 10
+
+struct viper_waiter {
+	struct viper_waiter *next;
+};
+
 struct viper_device {
 	char name[255];
 	int media_fd;
 	struct viper_entity *entity_list;
 	struct viper_io_entity *io_entity_list;
+	pthread_mutex_t lock;
+	/* protects the cached link flags of all entities */
+	pthread_mutex_t link_lock;
+	struct viper_pipeline *pipeline_cache;
+	int cached_pipelines;
+	/* pipelines waiting for entities, oldest first */
+	pthread_cond_t released;
+	struct viper_waiter *waiters;
+	unsigned int waits;
+	unsigned int timeouts;
+	/* jobs queued on the device by this process */
+	int inflight;
 	struct viper_device *next;
 };
 
@@ -81,34 +144,107 @@ struct viper_context {
 	struct viper_device *device_list;
 	pthread_mutex_t	lock;
 	int ref_cnt;
+	/* open entity nodes, 0 max_open_nodes means no limit */
+	int open_nodes;
+	int max_open_nodes;
+	unsigned long lock_count;
+	/* thread expiring idle cached pipelines, see cache_reaper */
+	pthread_t reaper;
+	pthread_mutex_t reaper_lock;
+	pthread_cond_t reaper_wake;
+	bool reaper_running;
+	bool reaper_stop;
 };
 
 #define MAX_INPUT_BUFFERS 4
 #define MAX_OUTPUT_BUFFERS 4
 #define MAX_PLANES 2
+/* Buffer slots requested on each queue of a streaming pipeline */
+#define MAX_QUEUE_DEPTH 4
+
+/* A driver allocated (V4L2_MEMORY_MMAP) buffer, mapped and exported */
+struct viper_buffer {
+	int	planes;
+	void	*addr[MAX_PLANES];
+	int	dmabuf[MAX_PLANES];
+	int	length[MAX_PLANES];
+};
 
 struct viper_pipeline {
+	struct viper_device *dev;
 	int	num_inputs;
 	int	num_outputs;
 	struct viper_entity *locked_entities;
 	int active_subpipe;
 	struct viper_entity *subpipe_final[MAX_SUBPIPES];
+	/* links the pipeline needs enabled, see reconcile_links */
+	struct media_link_desc *links[MAX_PIPELINE_ENTITIES];
+	int	num_links;
 
 	int	input_fds[MAX_INPUT_BUFFERS];
 	void	*input_addr[MAX_INPUT_BUFFERS][MAX_PLANES];
+	int	input_dmabuf[MAX_INPUT_BUFFERS][MAX_PLANES];
 	int	input_size[MAX_INPUT_BUFFERS][MAX_PLANES];
 	int	input_planes[MAX_INPUT_BUFFERS];
+	/* memory type of the next buffer and of the streaming queue */
+	enum v4l2_memory input_memory[MAX_INPUT_BUFFERS];
+	enum v4l2_memory input_queue_memory[MAX_INPUT_BUFFERS];
+	/* MMAP buffer pool and the pool buffer used by the next job */
+	struct viper_buffer *input_pool[MAX_INPUT_BUFFERS];
+	int	input_pool_size[MAX_INPUT_BUFFERS];
+	int	input_index[MAX_INPUT_BUFFERS];
 
 	int	output_fds[MAX_OUTPUT_BUFFERS];
 	void	*output_addr[MAX_OUTPUT_BUFFERS][MAX_PLANES];
+	int	output_dmabuf[MAX_OUTPUT_BUFFERS][MAX_PLANES];
 	int	output_size[MAX_OUTPUT_BUFFERS][MAX_PLANES];
 	int	output_planes[MAX_OUTPUT_BUFFERS];
+	enum v4l2_memory output_memory[MAX_OUTPUT_BUFFERS];
+	enum v4l2_memory output_queue_memory[MAX_OUTPUT_BUFFERS];
+	struct viper_buffer *output_pool[MAX_OUTPUT_BUFFERS];
+	int	output_pool_size[MAX_OUTPUT_BUFFERS];
+	int	output_index[MAX_OUTPUT_BUFFERS];
+
+	bool	streaming;
+	int	buffers;
+	int	next_index;
+	int	queued;
+
+/* cache key: the caps list and a copy of each entity config */
+	int	length;
+	int	caps_list[MAX_PIPELINE_ENTITIES];
+	void	*args_list[MAX_PIPELINE_ENTITIES];
+	struct timespec last_used;
+	struct viper_pipeline *next_cached;
 };
 
 struct viper_pipeline * create_pipeline(struct viper_device *dev,
-		int *caps_list, void **args_list, int length);
+		int *caps_list, void **args_list, int length, int timeout_ms);
+bool pipeline_matches(struct viper_pipeline *pipe, int *caps_list,
+		      void **args_list, int length);
+bool pipeline_fits(struct viper_pipeline *pipe, int *caps_list,
+		   void **args_list, int length);
+int update_pipeline(struct viper_pipeline *pipe, void **args_list);
+void free_pipeline(struct viper_device *dev, struct viper_pipeline *pipe);
+void release_pipeline(struct viper_device *dev, struct viper_pipeline *pipe);
+int flush_pipeline_cache(struct viper_device *dev);
+int reconfig_pipeline(struct viper_pipeline *pipe, int *caps, void **args,
+		      int count);
 
-int queue_buffer(int fd, void **buffer, int *size, int count, bool input);
+int start_io_device(int fd, bool input, enum v4l2_memory memory, int count);
+int stop_io_device(int fd, bool input, enum v4l2_memory memory);
+int start_pipeline(struct viper_pipeline *pipe);
+void stop_pipeline(struct viper_pipeline *pipe);
+void pipeline_job_queued(struct viper_pipeline *pipe);
+void pipeline_job_done(struct viper_pipeline *pipe);
+int sync_pipeline_memory(struct viper_pipeline *pipe);
+int alloc_pipeline_buffers(struct viper_pipeline *pipe, bool input, int idx,
+			   int count);
+void free_pipeline_buffers(struct viper_pipeline *pipe);
+bool pipeline_has_buffers(struct viper_pipeline *pipe);
+int queue_buffer(int fd, int index, enum v4l2_memory memory, void **buffer,
+		 int *dmabuf, int *size, int count, bool input);
+int dequeue_buffer(int fd, bool input, enum v4l2_memory memory);
 
 static enum v4l2_mbus_pixelcode color_fmt_to_code(uint32_t format) {
 	switch (format) {
@@ -122,4 +258,5 @@ static enum v4l2_mbus_pixelcode color_fmt_to_code(uint32_t format) {
 	}
 }
 int init_context ();
+int deinit_context();
 #endif